@@ -1,14 +1,30 @@
 #include "libraries/fssimplewindow.h"
 #include "libraries/yspng.h"
 #include "libraries/yssimplesound.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
 #include <cstdlib>
+#include <functional>
 #include <iostream>
+#include <map>
 #include <math.h>
+#include <memory>
+#include <mutex>
 #include <queue>
 #include <stdio.h>
+#include <string.h>
+#include <string>
+#include <thread>
 #include <time.h>
 #include <vector>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
 using namespace std;
 
 // pattern constants
@@ -19,17 +35,69 @@ const int PATTERN_TWICE = 3;
 
 // other constants
 const int WIDTH = 1024;               // default window width
-const int HEIGHT = 768;               // default window height
+const int HEIGHT = 768;               // default window height, and the
+                                      // height of the world in world units
 const float VOLUME = 0.1;             // volume of the sound effects
 const int NUM_STARS = 50;             // number of stars
-const int MAX_TRAIL_PARTICLES = 1000; // max number of trailing particles
+const int MAX_TRAIL_PARTICLES = 256;  // max trail samples per particle
+const int MAX_FADE_REPEAT = 16;       // max number of trail fades per update
 const int SECOND_BURST_DELAY = 60; // secondary burst delay in count iterations
 const int BURST_RAND = 30;         // burst angle BURST_RAND in degrees
+const int NUM_BURST_VOICES = 8;    // number of bursts that can sound at once
+const int SIM_STEP_MS = 10;        // simulated time per update in milliseconds
+const int MAX_STEPS_PER_FRAME = 5; // max updates to catch up in one frame
 const double PI = 3.1415927;       // pi
+const float PARTICLE_SIZE = 2.5;   // point size of particles and trails
+const float STAR_SIZE = 2.5;       // point size of stars
+const int TILE_SIZE = 64;          // side of a software renderer tile
+const float ACCUM_FADE = 0.009f;   // accumulated trail alpha lost per update
+const float ACCUM_TINT = 0.005f;   // accumulated trail red shift per update
+const float BLOOM_THRESHOLD = 0.3f; // brightness where the glow starts
+const int BLOOM_BAND = 16;         // rows per vertical blur task
+const int BLOOM_STRIP = 256;       // columns per vertical blur step
+const int SOUND_QUEUE_SIZE = 64;   // sounds waiting for the main thread
+const int COMMAND_QUEUE_SIZE = 16; // commands waiting for the sim thread
+const int STAMP_SUBPIXELS = 16;    // smooth point positions per pixel and axis
+const int RESAMPLE_BAND = 8;       // output rows per resampling task
+const int LANCZOS_LOBES = 3;       // lobes of the Lanczos filter
+
+// PCG32 random number generator (pcg-random.org). every firework and particle
+// owns a generator split off its parent's, all the way up to the show seed, so
+// a seed reproduces the show exactly no matter which thread updates what
+class Pcg32 {
+private:
+  uint64_t state; // current state
+  uint64_t inc;   // stream selector, always odd
+
+public:
+  explicit Pcg32(uint64_t seed = 0x853C49E6748FEA9BULL,
+                 uint64_t stream = 0xDA3E39CB94B95BDBULL)
+      : state(0), inc((stream << 1) | 1) {
+    next();
+    state += seed;
+    next();
+  }
+
+  // returns 32 random bits
+  uint32_t next() {
+    uint64_t old = state;
+    state = old * 6364136223846793005ULL + inc;
+    uint32_t xorshifted = uint32_t(((old >> 18) ^ old) >> 27);
+    uint32_t rot = uint32_t(old >> 59);
+    return (xorshifted >> rot) | (xorshifted << ((32 - rot) & 31));
+  }
+
+  // returns a new generator whose seed and stream are drawn from this one
+  Pcg32 split() {
+    uint64_t seed = (uint64_t(next()) << 32) | next();
+    uint64_t stream = (uint64_t(next()) << 32) | next();
+    return Pcg32(seed, stream);
+  }
+};
 
 // custom randRange function that returns a random double in the range [lo, hi)
-double randRange(double lo, double hi) {
-  return lo + double(rand()) / double(RAND_MAX) * (hi - lo);
+double randRange(Pcg32 &rng, double lo, double hi) {
+  return lo + double(rng.next()) / 4294967296.0 * (hi - lo);
 }
 
 // color class to simplify passing colors as arguments
@@ -53,99 +121,843 @@ public:
   void use() const { glColor4f(r, g, b, a); }
 };
 
-// trail particles are particles that only make up the trail of a main particle
-class TrailParticle {
-private:
-  double x, y;      // position
+// converts a color channel in [0, 1] to a byte, clamping it first
+inline unsigned char toByte(float v) {
+  return (unsigned char)(min(max(v, 0.0f), 1.0f) * 255.0f + 0.5f);
+}
+
+// one vertex of a RenderBatch, laid out for glVertexPointer/glColorPointer
+struct BatchVertex {
+  float x, y;       // position
   float r, g, b, a; // color
+};
+
+// draws the primitives of the show. every primitive is alpha blended with
+// GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA. positions and sizes are in world
+// units: the world is HEIGHT units high and as wide as the aspect ratio of
+// the frame makes it, and renderers scale it to their number of pixels
+class Renderer {
+public:
+  virtual ~Renderer() {}
+
+  // sets the static layers. every frame starts from the background, a
+  // vertical gradient from top to bottom, and drawForeground() draws the
+  // foreground, an RGBA image of imgWid x imgHei pixels with its rows stored
+  // from bottom to top like glDrawPixels, stretched over the world rectangle
+  // wid x hei whose bottom left corner is at (x, y). renderers keep both
+  // between frames; call these again when they change. the image must stay
+  // alive while it is the foreground
+  virtual void setBackground(const Color &top, const Color &bottom) = 0;
+  virtual void setForeground(float x, float y, float wid, float hei,
+                             int imgWid, int imgHei,
+                             const unsigned char rgba[]) = 0;
+
+  // draws points as anti-aliased discs instead of squares
+  virtual void setSmoothPoints(bool smooth) = 0;
+  // pixels per world unit of what the renderer draws into
+  virtual float getScale() const = 0;
+
+  // starts a frame from the background
+  virtual void beginFrame() = 0;
+  // draws square points of the given size, or discs with smooth points
+  virtual void drawPoints(const BatchVertex vertices[], size_t count,
+                          float size) = 0;
+  // draws one pixel wide lines, two vertices per line
+  virtual void drawLines(const BatchVertex vertices[], size_t count) = 0;
+  // draws the foreground over what was drawn so far
+  virtual void drawForeground() = 0;
+  // blends a wid x hei image stretched over the whole frame. the image is
+  // given as premultiplied color planes with rows from top to bottom, and
+  // must stay alive until endFrame
+  virtual void drawLayer(int wid, int hei, const float r[], const float g[],
+                         const float b[], const float a[]) = 0;
+  // finishes the frame
+  virtual void endFrame() {}
+};
+
+// draws through OpenGL into the window
+class GlRenderer : public Renderer {
+private:
+  float scale;                   // pixels per world unit
+  float worldWid;                // width of the window in world units
+  Color top = Color(0, 0, 0);    // background colors
+  Color bottom = Color(0, 0, 0);
+  float fgX = 0, fgY = 0, fgWid = 0, fgHei = 0; // foreground placement
+  int fgImgWid = 0, fgImgHei = 0; // foreground size in pixels
+  const unsigned char *foreground = nullptr; // foreground pixels
+  GLuint texture = 0;         // foreground, uploaded once
+  bool textureDirty = false;  // set when the foreground has changed
+  GLuint layerTexture = 0;    // layer of the current frame
+  vector<unsigned char> layerPixels; // layer converted for uploading
+  bool smoothPoints = false;  // draw points with GL_POINT_SMOOTH
+
+  void drawArrays(GLenum mode, const BatchVertex vertices[], size_t count) {
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_COLOR_ARRAY);
+    glVertexPointer(2, GL_FLOAT, sizeof(BatchVertex), &vertices[0].x);
+    glColorPointer(4, GL_FLOAT, sizeof(BatchVertex), &vertices[0].r);
+    glDrawArrays(mode, 0, GLsizei(count));
+    glDisableClientState(GL_COLOR_ARRAY);
+    glDisableClientState(GL_VERTEX_ARRAY);
+  }
+
+  void uploadForeground() {
+    if (texture == 0) {
+      glGenTextures(1, &texture);
+    }
+    glBindTexture(GL_TEXTURE_2D, texture);
+    // the image is stretched to the window, so filter it when it is scaled
+    const GLint filter = (fgImgWid == int(fgWid * scale + 0.5f) &&
+                          fgImgHei == int(fgHei * scale + 0.5f))
+                             ? GL_NEAREST
+                             : GL_LINEAR;
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, fgImgWid, fgImgHei, 0, GL_RGBA,
+                 GL_UNSIGNED_BYTE, foreground);
+    textureDirty = false;
+  }
 
 public:
-  TrailParticle(double x, double y, Color color) : x(x), y(y) {
-    r = color.getR();
-    g = color.getG();
-    b = color.getB();
-    a = color.getA();
+  // draws into a window of wid x hei pixels
+  GlRenderer(int wid, int hei)
+      : scale(float(hei) / HEIGHT), worldWid(wid / scale) {}
+
+  float getScale() const override { return scale; }
+
+  ~GlRenderer() {
+    if (texture != 0) {
+      glDeleteTextures(1, &texture);
+    }
+    if (layerTexture != 0) {
+      glDeleteTextures(1, &layerTexture);
+    }
   }
 
-  // they should fade the trail particles s that they disappear
-  void fade(int repeat = 1) {
+  void setBackground(const Color &newTop, const Color &newBottom) override {
+    top = newTop;
+    bottom = newBottom;
+  }
+
+  void setForeground(float x, float y, float wid, float hei, int imgWid,
+                     int imgHei, const unsigned char rgba[]) override {
+    fgX = x;
+    fgY = y;
+    fgWid = wid;
+    fgHei = hei;
+    fgImgWid = imgWid;
+    fgImgHei = imgHei;
+    foreground = rgba;
+    textureDirty = true;
+  }
+
+  void setSmoothPoints(bool smooth) override { smoothPoints = smooth; }
+
+  void beginFrame() override {
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    glMatrixMode(GL_MODELVIEW); // world units to pixels
+    glLoadIdentity();
+    glScalef(scale, scale, 1.0f);
+    glBegin(GL_QUADS);
+    top.use();
+    glVertex2f(0, 0);
+    glVertex2f(worldWid, 0);
+    bottom.use();
+    glVertex2f(worldWid, HEIGHT);
+    glVertex2f(0, HEIGHT);
+    glEnd();
+  }
+
+  void drawPoints(const BatchVertex vertices[], size_t count,
+                  float size) override {
+    glPointSize(size * scale);
+    if (smoothPoints) {
+      glEnable(GL_POINT_SMOOTH);
+    }
+    drawArrays(GL_POINTS, vertices, count);
+    glDisable(GL_POINT_SMOOTH);
+  }
+
+  void drawLines(const BatchVertex vertices[], size_t count) override {
+    drawArrays(GL_LINES, vertices, count);
+  }
+
+  void drawForeground() override {
+    if (foreground == nullptr || fgImgWid <= 0 || fgImgHei <= 0) {
+      return;
+    }
+    if (textureDirty) {
+      uploadForeground();
+    }
+    // texture row 0 is the bottom row of the image
+    const float bottomY = fgY, topY = fgY - fgHei;
+    glEnable(GL_TEXTURE_2D);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glColor4f(1.0f, 1.0f, 1.0f, 1.0f);
+    glBegin(GL_QUADS);
+    glTexCoord2f(0.0f, 0.0f);
+    glVertex2f(fgX, bottomY);
+    glTexCoord2f(1.0f, 0.0f);
+    glVertex2f(fgX + fgWid, bottomY);
+    glTexCoord2f(1.0f, 1.0f);
+    glVertex2f(fgX + fgWid, topY);
+    glTexCoord2f(0.0f, 1.0f);
+    glVertex2f(fgX, topY);
+    glEnd();
+    glDisable(GL_TEXTURE_2D);
+  }
+
+  void drawLayer(int wid, int hei, const float r[], const float g[],
+                 const float b[], const float a[]) override {
+    const size_t n = size_t(wid) * hei;
+    layerPixels.resize(n * 4);
+    for (size_t i = 0; i < n; ++i) {
+      layerPixels[i * 4] = toByte(r[i]);
+      layerPixels[i * 4 + 1] = toByte(g[i]);
+      layerPixels[i * 4 + 2] = toByte(b[i]);
+      layerPixels[i * 4 + 3] = toByte(a[i]);
+    }
+    if (layerTexture == 0) {
+      glGenTextures(1, &layerTexture);
+    }
+    glBindTexture(GL_TEXTURE_2D, layerTexture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, wid, hei, 0, GL_RGBA,
+                 GL_UNSIGNED_BYTE, layerPixels.data());
+    // the colors are already multiplied by alpha; texture row 0 is the top
+    glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+    glEnable(GL_TEXTURE_2D);
+    glColor4f(1.0f, 1.0f, 1.0f, 1.0f);
+    glBegin(GL_QUADS);
+    glTexCoord2f(0.0f, 0.0f);
+    glVertex2f(0, 0);
+    glTexCoord2f(1.0f, 0.0f);
+    glVertex2f(worldWid, 0);
+    glTexCoord2f(1.0f, 1.0f);
+    glVertex2f(worldWid, HEIGHT);
+    glTexCoord2f(0.0f, 1.0f);
+    glVertex2f(0, HEIGHT);
+    glEnd();
+    glDisable(GL_TEXTURE_2D);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+  }
+};
+
+// frame-level batch of points and lines. draw code adds primitives to the
+// batch instead of drawing every point by itself, and draw() submits each
+// point size and the lines to the renderer with one call each. points are
+// drawn before lines, each in the order they were added
+class RenderBatch {
+private:
+  // points of one size
+  struct PointGroup {
+    float size;
+    vector<BatchVertex> vertices;
+  };
+
+  vector<PointGroup> pointGroups; // points, grouped by size
+  vector<BatchVertex> lines;      // line segments, two vertices each
+
+  static BatchVertex vertex(float x, float y, const Color &color) {
+    BatchVertex v = {x, y, color.getR(), color.getG(), color.getB(),
+                     color.getA()};
+    return v;
+  }
+
+public:
+  void addPoint(float x, float y, float size, const Color &color) {
+    for (auto &group : pointGroups) {
+      if (group.size == size) {
+        group.vertices.push_back(vertex(x, y, color));
+        return;
+      }
+    }
+    pointGroups.push_back(PointGroup());
+    pointGroups.back().size = size;
+    pointGroups.back().vertices.push_back(vertex(x, y, color));
+  }
+
+  void addLine(float x0, float y0, float x1, float y1, const Color &color) {
+    lines.push_back(vertex(x0, y0, color));
+    lines.push_back(vertex(x1, y1, color));
+  }
+
+  // empties the batch, keeping its memory
+  void clear() {
+    for (auto &group : pointGroups) {
+      group.vertices.clear();
+    }
+    lines.clear();
+  }
+
+  // draws everything in the batch and returns the number of renderer calls
+  int draw(Renderer &renderer) const {
+    int calls = 0;
+    for (const auto &group : pointGroups) {
+      if (!group.vertices.empty()) {
+        renderer.drawPoints(group.vertices.data(), group.vertices.size(),
+                            group.size);
+        ++calls;
+      }
+    }
+    if (!lines.empty()) {
+      renderer.drawLines(lines.data(), lines.size());
+      ++calls;
+    }
+    return calls;
+  }
+};
+
+// what one frame of the show looks like: positions and colors for the
+// renderer and nothing else, so it can be drawn while the show moves on
+struct RenderSnapshot {
+  RenderBatch sky;       // stars and shooting stars, behind the skyline
+  RenderBatch fireworks; // trails and particles, in front of it
+  vector<float> layer[4]; // copy of the accumulated trails, if taken
+  const float *layerPlanes[4] = {}; // accumulated trails to draw, or null
+  int layerWid = 0, layerHei = 0;   // size of the accumulated trails
+
+  // draws the frame and returns the number of renderer calls
+  int draw(Renderer &renderer) const {
+    renderer.beginFrame(); // starts from the gradient
+    int calls = sky.draw(renderer);
+    renderer.drawForeground();
+    if (layerPlanes[3] != nullptr) {
+      renderer.drawLayer(layerWid, layerHei, layerPlanes[0], layerPlanes[1],
+                         layerPlanes[2], layerPlanes[3]);
+    }
+    calls += fireworks.draw(renderer);
+    renderer.endFrame();
+    return calls;
+  }
+};
+
+// counter-based random number generator: hashes (key, counter) into 32 random
+// bits, so every sample (and every SIMD lane) draws independently of the others
+inline unsigned int hashRandom(unsigned int key, unsigned int counter) {
+  unsigned int h = key ^ (counter * 0x9E3779B9u);
+  h ^= h >> 16;
+  h *= 0x7FEB352Du;
+  h ^= h >> 15;
+  h *= 0x846CA68Bu;
+  h ^= h >> 16;
+  return h;
+}
+
+// closed form of repeating the trail fade step `repeat` times. each step
+// brightens by 0.005 with a 1 in 5 chance and dims by 0.0025 otherwise, so the
+// number of brightening steps k is binomial(repeat, 1/5) and the total change
+// is 0.0075 * k - 0.0025 * repeat. k is drawn by comparing a 24 bit uniform
+// number against the cumulative distribution
+class FadeTable {
+public:
+  int repeat;                     // number of fade steps
+  int threshold[MAX_FADE_REPEAT]; // 2^24 * P(k <= j)
+  float base;                     // change when no step brightens
+
+  explicit FadeTable(int repeat) : repeat(repeat) {
+    double p = 1, cdf = 0;
     for (int i = 0; i < repeat; ++i) {
-      // 1 in 5 chance to increase brightness (flashing effect)
-      if (rand() % 5 == 0) {
-        a += 0.005;
-        if (a > 1)
-          a = 1;
-      } else {
-        a -= 0.0025;
+      p *= 0.8; // probability of k = 0
+    }
+    for (int j = 0; j < repeat; ++j) {
+      cdf += p;
+      threshold[j] = int(cdf * (1 << 24) + 0.5);
+      p *= double(repeat - j) / double(j + 1) * 0.25; // P(k = j + 1)
+    }
+    base = -0.0025f * repeat;
+  }
+
+  static vector<FadeTable> makeTables() {
+    vector<FadeTable> tables;
+    for (int i = 0; i <= MAX_FADE_REPEAT; ++i) {
+      tables.push_back(FadeTable(i));
+    }
+    return tables;
+  }
+
+  static const FadeTable &get(int repeat) {
+    static const vector<FadeTable> tables = makeTables();
+    return tables[repeat];
+  }
+};
+
+// fades and recolors the trail samples in [begin, end), all of which fade
+// `repeat` times per update. the random numbers of sample i are
+// hashRandom(key, 2 * i) for the fade and hashRandom(key, 2 * i + 1) for the
+// blue jitter
+typedef void (*TrailKernel)(float *r, float *g, float *b, float *a,
+                            size_t begin, size_t end, int repeat,
+                            unsigned int key);
+
+void trailKernelScalar(float *r, float *g, float *b, float *a, size_t begin,
+                       size_t end, int repeat, unsigned int key) {
+  const FadeTable &table = FadeTable::get(repeat);
+  for (size_t i = begin; i < end; ++i) {
+    int u = hashRandom(key, 2 * i) >> 8;
+    int k = 0;
+    for (int j = 0; j < repeat; ++j) {
+      k += (u >= table.threshold[j]);
+    }
+    a[i] = min(a[i] + (float(k) * 0.0075f + table.base), 1.0f);
+
+    r[i] = min(r[i] + 0.005f, 1.0f);
+    g[i] = max(g[i] - 0.005f, 0.0f);
+    // add random change to blue component in [-0.005, 0.005)
+    int v = hashRandom(key, 2 * i + 1) >> 8;
+    float jitter = float(v) * (0.01f / (1 << 24)) - 0.005f;
+    b[i] = min(max(b[i] + jitter, 0.0f), 1.0f);
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// the SIMD kernels below are the scalar kernel with every statement widened to
+// 4 (SSE4.1) or 8 (AVX2) lanes; leftover samples go through the scalar kernel
+
+__attribute__((target("sse4.1"))) inline __m128i
+hashRandom4(__m128i key, __m128i counter) {
+  __m128i h = _mm_xor_si128(
+      key, _mm_mullo_epi32(counter, _mm_set1_epi32(0x9E3779B9u)));
+  h = _mm_xor_si128(h, _mm_srli_epi32(h, 16));
+  h = _mm_mullo_epi32(h, _mm_set1_epi32(0x7FEB352Du));
+  h = _mm_xor_si128(h, _mm_srli_epi32(h, 15));
+  h = _mm_mullo_epi32(h, _mm_set1_epi32(0x846CA68Bu));
+  return _mm_xor_si128(h, _mm_srli_epi32(h, 16));
+}
+
+__attribute__((target("sse4.1"))) void
+trailKernelSse41(float *r, float *g, float *b, float *a, size_t begin,
+                 size_t end, int repeat, unsigned int key) {
+  const FadeTable &table = FadeTable::get(repeat);
+  const __m128i vkey = _mm_set1_epi32(key);
+  const __m128i lane = _mm_setr_epi32(0, 2, 4, 6);
+  const __m128 one = _mm_set1_ps(1.0f), zero = _mm_setzero_ps();
+  const __m128 step = _mm_set1_ps(0.005f);
+  size_t i = begin;
+  for (; i + 4 <= end; i += 4) {
+    __m128i counter = _mm_add_epi32(_mm_set1_epi32(2 * i), lane);
+    __m128i u = _mm_srli_epi32(hashRandom4(vkey, counter), 8);
+    __m128i less = _mm_setzero_si128();
+    for (int j = 0; j < repeat; ++j) {
+      less = _mm_add_epi32(
+          less, _mm_cmpgt_epi32(_mm_set1_epi32(table.threshold[j]), u));
+    }
+    __m128 k = _mm_cvtepi32_ps(_mm_add_epi32(_mm_set1_epi32(repeat), less));
+    __m128 delta = _mm_add_ps(_mm_mul_ps(k, _mm_set1_ps(0.0075f)),
+                              _mm_set1_ps(table.base));
+    _mm_storeu_ps(a + i, _mm_min_ps(_mm_add_ps(_mm_loadu_ps(a + i), delta), one));
+
+    _mm_storeu_ps(r + i, _mm_min_ps(_mm_add_ps(_mm_loadu_ps(r + i), step), one));
+    _mm_storeu_ps(g + i, _mm_max_ps(_mm_sub_ps(_mm_loadu_ps(g + i), step), zero));
+    counter = _mm_add_epi32(counter, _mm_set1_epi32(1));
+    __m128i v = _mm_srli_epi32(hashRandom4(vkey, counter), 8);
+    __m128 jitter =
+        _mm_sub_ps(_mm_mul_ps(_mm_cvtepi32_ps(v), _mm_set1_ps(0.01f / (1 << 24))),
+                   step);
+    __m128 blue = _mm_add_ps(_mm_loadu_ps(b + i), jitter);
+    _mm_storeu_ps(b + i, _mm_min_ps(_mm_max_ps(blue, zero), one));
+  }
+  trailKernelScalar(r, g, b, a, i, end, repeat, key);
+}
+
+__attribute__((target("avx2"))) inline __m256i hashRandom8(__m256i key,
+                                                            __m256i counter) {
+  __m256i h = _mm256_xor_si256(
+      key, _mm256_mullo_epi32(counter, _mm256_set1_epi32(0x9E3779B9u)));
+  h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 16));
+  h = _mm256_mullo_epi32(h, _mm256_set1_epi32(0x7FEB352Du));
+  h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 15));
+  h = _mm256_mullo_epi32(h, _mm256_set1_epi32(0x846CA68Bu));
+  return _mm256_xor_si256(h, _mm256_srli_epi32(h, 16));
+}
+
+__attribute__((target("avx2"))) void
+trailKernelAvx2(float *r, float *g, float *b, float *a, size_t begin,
+                size_t end, int repeat, unsigned int key) {
+  const FadeTable &table = FadeTable::get(repeat);
+  const __m256i vkey = _mm256_set1_epi32(key);
+  const __m256i lane = _mm256_setr_epi32(0, 2, 4, 6, 8, 10, 12, 14);
+  const __m256 one = _mm256_set1_ps(1.0f), zero = _mm256_setzero_ps();
+  const __m256 step = _mm256_set1_ps(0.005f);
+  size_t i = begin;
+  for (; i + 8 <= end; i += 8) {
+    __m256i counter = _mm256_add_epi32(_mm256_set1_epi32(2 * i), lane);
+    __m256i u = _mm256_srli_epi32(hashRandom8(vkey, counter), 8);
+    __m256i less = _mm256_setzero_si256();
+    for (int j = 0; j < repeat; ++j) {
+      less = _mm256_add_epi32(
+          less, _mm256_cmpgt_epi32(_mm256_set1_epi32(table.threshold[j]), u));
+    }
+    __m256 k =
+        _mm256_cvtepi32_ps(_mm256_add_epi32(_mm256_set1_epi32(repeat), less));
+    __m256 delta = _mm256_add_ps(_mm256_mul_ps(k, _mm256_set1_ps(0.0075f)),
+                                 _mm256_set1_ps(table.base));
+    _mm256_storeu_ps(
+        a + i, _mm256_min_ps(_mm256_add_ps(_mm256_loadu_ps(a + i), delta), one));
+
+    _mm256_storeu_ps(
+        r + i, _mm256_min_ps(_mm256_add_ps(_mm256_loadu_ps(r + i), step), one));
+    _mm256_storeu_ps(
+        g + i, _mm256_max_ps(_mm256_sub_ps(_mm256_loadu_ps(g + i), step), zero));
+    counter = _mm256_add_epi32(counter, _mm256_set1_epi32(1));
+    __m256i v = _mm256_srli_epi32(hashRandom8(vkey, counter), 8);
+    __m256 jitter = _mm256_sub_ps(
+        _mm256_mul_ps(_mm256_cvtepi32_ps(v), _mm256_set1_ps(0.01f / (1 << 24))),
+        step);
+    __m256 blue = _mm256_add_ps(_mm256_loadu_ps(b + i), jitter);
+    _mm256_storeu_ps(b + i, _mm256_min_ps(_mm256_max_ps(blue, zero), one));
+  }
+  trailKernelScalar(r, g, b, a, i, end, repeat, key);
+}
+#endif
+
+// picks the widest trail kernel the CPU supports
+TrailKernel pickTrailKernel() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return trailKernelAvx2;
+  } else if (__builtin_cpu_supports("sse4.1")) {
+    return trailKernelSse41;
+  }
+#endif
+  return trailKernelScalar;
+}
+
+TrailKernel getTrailKernel() {
+  static const TrailKernel kernel = pickTrailKernel();
+  return kernel;
+}
+
+// structure-of-arrays store for all trail samples of one firework. every
+// emitter of the firework (main, burst and secondary particles) owns a fixed
+// block of MAX_TRAIL_PARTICLES slots in the same contiguous arrays, used as a
+// ring buffer from its oldest to its newest sample. blocks are only allocated
+// while the pool warms up; clear() keeps them for the next firework
+class TrailPool {
+private:
+  // ring buffer bookkeeping of one emitter
+  struct Ring {
+    int oldest; // slot of the oldest sample, relative to the block
+    int count;  // number of samples in the ring
+    int decay;  // number of times to fade the samples per update
+  };
+
+  vector<float> x, y;       // positions
+  vector<float> r, g, b, a; // colors
+  vector<Ring> rings;       // rings of the emitters in use
+  size_t numBlocks = 0;     // number of blocks allocated in the arrays
+  unsigned int seed;        // key of the trail's random numbers
+  unsigned int frame = 0;   // number of updates so far
+  int limit = MAX_TRAIL_PARTICLES; // max number of samples per emitter
+
+public:
+  explicit TrailPool(unsigned int seed) : seed(seed) {}
+
+  // forgets all emitters and samples, keeping the memory for reuse
+  void clear(unsigned int newSeed) {
+    rings.clear();
+    seed = newSeed;
+    frame = 0;
+  }
+
+  // registers a new emitter and returns its index. the emitter's block of
+  // samples is allocated by its first emit(), so emitters get no memory
+  // while the limit is 0, e.g. when the trails are accumulated instead
+  int addEmitter(int decaySpeed) {
+    Ring ring = {0, 0, decaySpeed};
+    rings.push_back(ring);
+    return int(rings.size()) - 1;
+  }
+
+  // sets the number of samples kept per emitter, at most MAX_TRAIL_PARTICLES
+  // (0 keeps none)
+  void setLimit(int maxSamples) {
+    limit = min(max(maxSamples, 0), MAX_TRAIL_PARTICLES);
+  }
+
+  // adds a trail sample at the current position of an emitter, evicting the
+  // emitter's oldest samples when its ring holds as many as the limit
+  void emit(int emitter, double px, double py, const Color &color) {
+    if (color.getA() <= 0 || limit == 0) {
+      return; // would never be visible
+    }
+    if (size_t(emitter) >= numBlocks) {
+      numBlocks = rings.size(); // blocks for all emitters registered so far
+      const size_t slots = numBlocks * MAX_TRAIL_PARTICLES;
+      x.resize(slots);
+      y.resize(slots);
+      r.resize(slots);
+      g.resize(slots);
+      b.resize(slots);
+      a.resize(slots);
+    }
+    Ring &ring = rings[emitter];
+    while (ring.count >= limit) {
+      ring.oldest = (ring.oldest + 1) % MAX_TRAIL_PARTICLES;
+      --ring.count;
+    }
+    int slot = ring.oldest + ring.count;
+    ++ring.count;
+    const size_t i = emitter * size_t(MAX_TRAIL_PARTICLES) +
+                     slot % MAX_TRAIL_PARTICLES;
+    x[i] = px;
+    y[i] = py;
+    r[i] = color.getR();
+    g[i] = color.getG();
+    b[i] = color.getB();
+    a[i] = color.getA();
+  }
+
+  // returns the samples of an emitter, oldest first, as at most two ranges of
+  // array indices [begin[k], end[k]); returns the number of ranges
+  int spans(int emitter, size_t begin[2], size_t end[2]) const {
+    const Ring &ring = rings[emitter];
+    if (ring.count == 0) {
+      return 0;
+    }
+    const size_t base = emitter * size_t(MAX_TRAIL_PARTICLES);
+    const int last = ring.oldest + ring.count;
+    begin[0] = base + ring.oldest;
+    end[0] = base + min(last, MAX_TRAIL_PARTICLES);
+    if (last <= MAX_TRAIL_PARTICLES) {
+      return 1;
+    }
+    begin[1] = base;
+    end[1] = base + (last - MAX_TRAIL_PARTICLES);
+    return 2;
+  }
+
+  // fades, recolors and prunes every trail sample of the firework
+  void update() {
+    const unsigned int key = hashRandom(seed, frame++);
+    const TrailKernel kernel = getTrailKernel();
+    for (int e = 0; e < int(rings.size()); ++e) {
+      size_t begin[2], end[2];
+      const int n = spans(e, begin, end);
+      for (int k = 0; k < n; ++k) {
+        kernel(r.data(), g.data(), b.data(), a.data(), begin[k], end[k],
+               rings[e].decay, key);
+      }
+
+      // drop the oldest samples once they have faded out
+      Ring &ring = rings[e];
+      const size_t base = e * size_t(MAX_TRAIL_PARTICLES);
+      while (ring.count > 0 && a[base + ring.oldest] <= 0) {
+        ring.oldest = (ring.oldest + 1) % MAX_TRAIL_PARTICLES;
+        --ring.count;
+      }
+    }
+  }
+
+  // draws the trail particles
+  void draw(RenderBatch &batch) const {
+    for (int e = 0; e < int(rings.size()); ++e) {
+      size_t begin[2], end[2];
+      const int n = spans(e, begin, end);
+      for (int k = 0; k < n; ++k) {
+        for (size_t i = begin[k]; i < end[k]; ++i) {
+          if (a[i] <= 0) {
+            continue; // faded out, waiting for older samples to be dropped
+          }
+          batch.addPoint(x[i], y[i], PARTICLE_SIZE,
+                         Color(r[i], g[i], b[i], a[i]));
+        }
       }
     }
   }
+};
 
-  // updates the color of a trail particle
-  void updateColor() {
-    r += 0.005;
-    if (r > 1)
-      r = 1;
+// fades the premultiplied planes of a trail accumulation buffer by one
+// update the way burst trail samples fade on average: alpha drops by
+// ACCUM_FADE, and the color, which is scaled with it, moves ACCUM_TINT
+// towards red and away from green
+typedef void (*AccumKernel)(float *r, float *g, float *b, float *a,
+                            size_t begin, size_t end);
+
+void accumKernelScalar(float *r, float *g, float *b, float *a, size_t begin,
+                       size_t end) {
+  for (size_t i = begin; i < end; ++i) {
+    const float alpha = a[i] - ACCUM_FADE;
+    if (alpha <= 0) {
+      r[i] = g[i] = b[i] = a[i] = 0;
+      continue;
+    }
+    const float scale = alpha / a[i];
+    r[i] = min(r[i] * scale + ACCUM_TINT * alpha, alpha);
+    g[i] = max(g[i] * scale - ACCUM_TINT * alpha, 0.0f);
+    b[i] = b[i] * scale;
+    a[i] = alpha;
+  }
+}
 
-    g -= 0.005;
-    if (g < 0)
-      g = 0;
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2"))) void accumKernelAvx2(float *r, float *g,
+                                                     float *b, float *a,
+                                                     size_t begin,
+                                                     size_t end) {
+  const __m256 fade = _mm256_set1_ps(ACCUM_FADE);
+  const __m256 tint = _mm256_set1_ps(ACCUM_TINT);
+  const __m256 zero = _mm256_setzero_ps();
+  size_t i = begin;
+  for (; i + 8 <= end; i += 8) {
+    const __m256 old = _mm256_loadu_ps(a + i);
+    const __m256 alpha = _mm256_sub_ps(old, fade);
+    const __m256 keep = _mm256_cmp_ps(alpha, zero, _CMP_GT_OQ);
+    // lanes that are not kept are masked out below, so dividing by a zero
+    // alpha there does no harm
+    const __m256 scale = _mm256_div_ps(alpha, old);
+    const __m256 shift = _mm256_mul_ps(tint, alpha);
+    __m256 red = _mm256_min_ps(
+        _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(r + i), scale), shift),
+        alpha);
+    __m256 green = _mm256_max_ps(
+        _mm256_sub_ps(_mm256_mul_ps(_mm256_loadu_ps(g + i), scale), shift),
+        zero);
+    __m256 blue = _mm256_mul_ps(_mm256_loadu_ps(b + i), scale);
+    _mm256_storeu_ps(r + i, _mm256_and_ps(red, keep));
+    _mm256_storeu_ps(g + i, _mm256_and_ps(green, keep));
+    _mm256_storeu_ps(b + i, _mm256_and_ps(blue, keep));
+    _mm256_storeu_ps(a + i, _mm256_and_ps(alpha, keep));
+  }
+  _mm256_zeroupper(); // the scalar tail is SSE code
+  accumKernelScalar(r, g, b, a, i, end);
+}
+#endif
 
-    b += randRange(-0.005, 0.005); // add random change to blue component
-    if (b > 1)
-      b = 1;
-    if (b < 0)
-      b = 0;
+AccumKernel pickAccumKernel() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return accumKernelAvx2;
   }
+#endif
+  return accumKernelScalar;
+}
 
-  bool isGone() { return a <= 0; }
+AccumKernel getAccumKernel() {
+  static const AccumKernel kernel = pickAccumKernel();
+  return kernel;
+}
 
-  // draws the trail particle
-  void draw() const {
-    glPointSize(2.5);
-    glBegin(GL_POINTS);
-    glColor4f(r, g, b, a);
-    glVertex2d(x, y);
-    glEnd();
+// canvas-sized buffer that trails accumulate in, as an alternative to
+// TrailPool: every update the heads of the particles are drawn into it and
+// the whole buffer fades, so the cost depends on the number of pixels rather
+// than the number of trail samples. holds premultiplied float colors in
+// separate planes so the fade runs as one linear loop
+class TrailAccumulator {
+private:
+  int wid, hei;             // size in pixels
+  double scale;             // pixels per world unit
+  vector<float> r, g, b, a; // premultiplied color planes, rows top to bottom
+
+public:
+  // covers a world of worldWid x HEIGHT units at scale pixels per unit
+  TrailAccumulator(double worldWid, double scale)
+      : wid(max(1, int(worldWid * scale + 0.5))),
+        hei(max(1, int(HEIGHT * scale + 0.5))), scale(scale),
+        r(size_t(wid) * hei, 0), g(r), b(r), a(r) {}
+
+  int getWidth() const { return wid; }
+  int getHeight() const { return hei; }
+  double getScale() const { return scale; }
+  const float *getR() const { return r.data(); }
+  const float *getG() const { return g.data(); }
+  const float *getB() const { return b.data(); }
+  const float *getA() const { return a.data(); }
+
+  // fades the whole buffer by one update
+  void decay() {
+    getAccumKernel()(r.data(), g.data(), b.data(), a.data(), 0, r.size());
+  }
+
+  // blends a particle head at world position (px, py) over the buffer as a
+  // square of PARTICLE_SIZE world units
+  void deposit(double px, double py, const Color &color) {
+    const float alpha = min(max(color.getA(), 0.0f), 1.0f);
+    if (alpha <= 0) {
+      return; // would never be visible
+    }
+    const int width = max(1, int(PARTICLE_SIZE * scale + 0.5));
+    const int x0 = int(floor(px * scale - width * 0.5 + 0.5));
+    const int y0 = int(floor(py * scale - width * 0.5 + 0.5));
+    for (int y = max(y0, 0); y < min(y0 + width, hei); ++y) {
+      for (int x = max(x0, 0); x < min(x0 + width, wid); ++x) {
+        const size_t i = size_t(y) * wid + x;
+        // the head's color goes over the pixel's, but the pixel keeps the
+        // larger alpha rather than adding up, so it fades out when the
+        // brightest sample drawn into it would have
+        const float newA = max(a[i], alpha);
+        const float scale = a[i] > 0 ? (1.0f - alpha) * newA / a[i] : 0;
+        r[i] = color.getR() * alpha * newA + r[i] * scale;
+        g[i] = color.getG() * alpha * newA + g[i] * scale;
+        b[i] = color.getB() * alpha * newA + b[i] * scale;
+        a[i] = newA;
+      }
+    }
   }
 };
 
+// particle budget for one quality level, chosen by the QualityGovernor
+struct QualitySettings {
+  int maxTrail;           // trail samples kept per particle
+  int launchCount;        // fireworks launched at a time
+  int launchInterval;     // updates between launches
+  int secondaryParticles; // particles per secondary burst
+};
+
+// quality levels from cheapest to the full show
+const QualitySettings QUALITY_LEVELS[] = {
+    {64, 2, 300, 3},
+    {96, 3, 250, 4},
+    {160, 3, 200, 5},
+    {MAX_TRAIL_PARTICLES, 4, 200, 6},
+};
+const int NUM_QUALITY_LEVELS =
+    sizeof(QUALITY_LEVELS) / sizeof(QUALITY_LEVELS[0]);
+
 class Particle {
 private:
   double x, y;              // position
   double vx, vy;            // velocity
+  double prevX, prevY;      // position before the last update
   double ax = 0;            // x acceleration
   double ay = 0.01;         // y acceleration
   double at = 0.03;         // tangential acceleration
   double decaySpeed;        // number of times to fade for different particles
   double fadeSpeed = 0.003; // default increment for each fade call
-  int burstPattern;         // burst pattern
-  bool isBurst = false;     // whether particles are from a burst
   bool hasBurst = false;    // whether particles have burst yet
 
-  deque<TrailParticle> trailParticles; // particles that make up the trail
-  vector<Particle> secondaryParticles; // particles created from secondary burst
-  bool hasSecondaryBurst = false;      // whether secondary burst has happened
-  bool shouldBurstTwice = false; // whether the particle should burst twice
-  int timeSinceMainBurst = 0;    // time since primary burst
+  TrailPool *trails;              // pool that holds the trail samples
+  int emitter;                    // index of the trail in the pool
+  Pcg32 rng;                      // random numbers of the particle
+  bool hasSecondaryBurst = false; // whether secondary burst has happened
+  int timeSinceMainBurst = 0;     // time since primary burst
 
   Color color; // color of particle
 
 public:
-  Particle(double x, double y, double vx, double vy, Color color,
-           bool isBurst = false, int burstPattern = PATTERN_DEFAULT)
-      : x(x), y(y), vx(vx), vy(vy), color(color), isBurst(isBurst),
-        burstPattern(burstPattern) {
+  Particle(TrailPool *trails, Pcg32 rng, double x, double y, double vx,
+           double vy, Color color, bool isBurst = false)
+      : x(x), y(y), vx(vx), vy(vy), prevX(x), prevY(y), trails(trails),
+        rng(rng), color(color) {
     decaySpeed = isBurst ? 9 : 7;
+    emitter = trails->addEmitter(decaySpeed);
   }
 
   double getX() const { return x; }
   double getY() const { return y; }
+  const Color &getColor() const { return color; }
 
   bool reachedPeak() const { return vy >= 0; }
 
-  void scheduleBurst() { shouldBurstTwice = true; }
-
   // fades the particle's color by fadeSpeed
   void fade(int repeat = 1) {
     for (int i = 0; i < repeat; ++i) {
@@ -153,16 +965,31 @@ public:
     }
   }
 
-  // update the particle's physics and visual properties
-  void update() {
+  // update the particle's physics and visual properties. the firework keeps
+  // its particles in buckets of the same kind and calls the matching
+  // specialization, so the pattern checks below are resolved at compile time:
+  // IsBurst is false only for the rising shell, and Pattern is the burst
+  // pattern (secondary particles use PATTERN_DEFAULT). particles of a
+  // secondary burst are added to secondaries
+  template <bool IsBurst, int Pattern>
+  void update(vector<Particle> &secondaries, const QualitySettings &quality) {
+    const bool isSpiral = Pattern == PATTERN_SPIRAL;
+    const bool burstsTwice =
+        Pattern == PATTERN_CHRYSANTHEMUM || Pattern == PATTERN_TWICE;
+
+    prevX = x;
+    prevY = y;
+
     // update velocity
     vx += ax;
     vy += ay;
 
-    // update tangential acceleration for spirals
-    if (burstPattern == PATTERN_SPIRAL) {
-      vx += -at * sin(atan2(vy, vx));
-      vy += at * cos(atan2(vy, vx));
+    // update tangential acceleration for spirals: push the velocity along its
+    // own normal, which turns it a little further every update.
+    // sin(atan2(vy, vx)) is vy / |v| and cos(atan2(vy, vx)) is vx / |v|
+    if (isSpiral) {
+      vx -= at * vy / speedOr1(vx, vy);
+      vy += at * vx / speedOr1(vx, vy);
     }
 
     // update position
@@ -170,118 +997,200 @@ public:
     y += vy;
 
     // fade the leading particle if it has bursted
-    if (isBurst) {
+    if (IsBurst) {
       fade(3);
     }
 
     // mark burst
-    if (!isBurst && !hasBurst && vy >= 0) {
+    if (!IsBurst && !hasBurst && vy >= 0) {
       hasBurst = true;
     }
 
     // start secondary burst
-    if (shouldBurstTwice) {
-      updateSecondaryBurst();
-    }
-
-    // keep number of trailParticles under MAX_TRAIL_PARTICLES
-    if (isBurst || !hasBurst) {
-      trailParticles.push_front(TrailParticle(x, y, color));
-      if (trailParticles.size() > MAX_TRAIL_PARTICLES) {
-        trailParticles.pop_front();
-      }
+    if (burstsTwice) {
+      updateSecondaryBurst<Pattern>(secondaries, quality.secondaryParticles);
     }
 
-    for (auto &particle : trailParticles) {
-      particle.fade(decaySpeed);
-      particle.updateColor();
+    // leave a trail sample (faded and pruned by the firework's TrailPool)
+    if (IsBurst || !hasBurst) {
+      trails->emit(emitter, x, y, color);
     }
+  }
 
-    // remove dead trail particles
-    while (!trailParticles.empty() && trailParticles.front().isGone()) {
-      trailParticles.pop_front();
-    }
+  // length of a velocity, or 1 for a standing particle (where atan2 gives
+  // the direction (1, 0))
+  static double speedOr1(double vx, double vy) {
+    double speed = sqrt(vx * vx + vy * vy);
+    return speed > 0 ? speed : 1;
   }
 
-  // creates a secondary burst when needed
-  void updateSecondaryBurst() {
+  // creates a secondary burst of numParticles when needed
+  template <int Pattern>
+  void updateSecondaryBurst(vector<Particle> &secondaries, int numParticles) {
     if (!hasSecondaryBurst && (timeSinceMainBurst >= SECOND_BURST_DELAY ||
-                               burstPattern == PATTERN_CHRYSANTHEMUM)) {
+                               Pattern == PATTERN_CHRYSANTHEMUM)) {
       // create secondary particles
-      const int numParticles = 6;
       double dtheta = 2 * PI / float(numParticles);
       const double initialSpeed = 0.5;
 
       for (int i = 0; i < numParticles; ++i) {
         double angle =
-            i * dtheta + randRange(-BURST_RAND, BURST_RAND) * PI / 180.0f;
+            i * dtheta + randRange(rng, -BURST_RAND, BURST_RAND) * PI / 180.0f;
         double vx = initialSpeed * cos(angle);
         double vy = initialSpeed * sin(angle);
 
-        secondaryParticles.push_back(Particle(x, y, vx, vy, color, true));
+        secondaries.push_back(
+            Particle(trails, rng.split(), x, y, vx, vy, color, true));
       }
       hasSecondaryBurst = true;
     }
-    for (auto &secondary : secondaryParticles) {
-      secondary.update();
-    }
     timeSinceMainBurst++;
   }
 
-  // draws secondary particles
-  void drawSecondary() {
-    for (auto &secondary : secondaryParticles) {
-      secondary.draw();
+  // draw the particle on the screen, alpha of the way from its previous
+  // position to its current one
+  void draw(RenderBatch &batch, double alpha) const {
+    batch.addPoint(prevX + (x - prevX) * alpha, prevY + (y - prevY) * alpha,
+                   PARTICLE_SIZE, color);
+  }
+};
+
+// a decoded sound shared by everything that loaded the same file. a sound
+// player plays the buffers of one SoundData one after another, so the sound
+// keeps a few prepared copies (voices) and rotates through them to let
+// overlapping bursts play at the same time
+class SharedSound {
+private:
+  vector<unique_ptr<YsSoundPlayer::SoundData>> voices; // prepared copies
+  int nextVoice = 0; // voice to play next
+
+public:
+  // takes over the decoded data and makes numVoices prepared copies of it
+  SharedSound(YsSoundPlayer::SoundData &decoded, YsSoundPlayer &player,
+              int numVoices) {
+    for (int i = 0; i < numVoices; ++i) {
+      voices.push_back(unique_ptr<YsSoundPlayer::SoundData>(
+          new YsSoundPlayer::SoundData));
+      if (i + 1 < numVoices) {
+        voices.back()->CopyFrom(decoded);
+      } else {
+        voices.back()->MoveFrom(decoded);
+      }
+      player.PreparePlay(*voices.back());
     }
   }
 
-  // draws trail particles
-  void drawTrail() {
-    for (auto &particle : trailParticles) {
-      particle.draw();
+  void setVolume(YsSoundPlayer &player, float volume) {
+    for (auto &voice : voices) {
+      player.SetVolume(*voice, volume);
     }
   }
 
-  // draw the particle on the screen
-  void draw() {
-    glPointSize(2.5);
-    glBegin(GL_POINTS);
-    color.use();
-    glVertex2d(x, y);
-    glEnd();
-    drawTrail();
-    drawSecondary();
+  void play(YsSoundPlayer &player) {
+    player.PlayOneShot(*voices[nextVoice]);
+    nextVoice = (nextVoice + 1) % voices.size();
+  }
+};
+
+// cache of decoded sounds keyed by file name, so each .wav file is read and
+// decoded once no matter how many fireworks use it. the cache does not own the
+// sounds: a sound is freed when its last user releases it
+class SoundCache {
+private:
+  map<string, weak_ptr<SharedSound>> sounds; // loaded sounds by file name
+  YsSoundPlayer &player;                     // player the sounds are for
+  bool enabled;                              // false to load no sound at all
+  int hits = 0;                              // loads served from the cache
+  int misses = 0;                            // loads that read the file
+
+public:
+  SoundCache(YsSoundPlayer &player, bool enabled)
+      : player(player), enabled(enabled) {}
+
+  // returns the shared sound of a .wav file, reading it on first use, or
+  // nullptr when the cache is disabled
+  shared_ptr<SharedSound> load(const char fn[], int numVoices = 1) {
+    if (!enabled) {
+      return nullptr;
+    }
+    shared_ptr<SharedSound> cached = sounds[fn].lock();
+    if (cached) {
+      ++hits;
+      return cached;
+    }
+    ++misses;
+    YsSoundPlayer::SoundData decoded;
+    decoded.LoadWav(fn);
+    shared_ptr<SharedSound> sound(new SharedSound(decoded, player, numVoices));
+    sounds[fn] = sound;
+    return sound;
   }
+
+  int getHits() const { return hits; }
+  int getMisses() const { return misses; }
 };
 
 class Firework {
 private:
+  Pcg32 rng;                           // random numbers of this firework
+  TrailPool trails;                    // trail samples of all particles
   Particle mainParticle;               // The main particle before the burst
   vector<Particle> burstParticles;     // particles created from burst
-  YsSoundPlayer &player;               // sound player for firework burst
-  YsSoundPlayer::SoundData burstSound; // sound data for firework burst
+  vector<Particle> secondaryParticles; // particles from secondary bursts
+  int burstPattern = PATTERN_DEFAULT;  // pattern of burstParticles
+  shared_ptr<SharedSound> burstSound;  // sound data for firework burst
 
-  bool hasBurst = false; // whether the firework has burst
-  Color color;           // color of the firework
+  bool hasBurst = false;      // whether the firework has burst
+  bool burstSounded = false;  // whether the burst sound has been played
+  Color color;                // color of the firework
 
 public:
   Firework(double startX, double startY, double startVx, double startVy,
-           Color color, YsSoundPlayer &player)
-      : color(color), player(player),
-        mainParticle(startX, startY, startVx, startVy, color) {
-    burstSound.LoadWav("burst.wav");
-    player.SetVolume(burstSound, VOLUME);
+           Color color, Pcg32 stream, SoundCache &sounds)
+      : rng(stream), trails(rng.next()), color(color),
+        mainParticle(&trails, rng.split(), startX, startY, startVx, startVy,
+                     color) {
+    burstSound = sounds.load("burst.wav", NUM_BURST_VOICES);
+  }
+
+  // reuses the firework for a new launch, keeping the memory of its trails
+  // and particles
+  void relaunch(double startX, double startY, double startVx, double startVy,
+                Color newColor, Pcg32 stream) {
+    rng = stream;
+    trails.clear(rng.next());
+    burstParticles.clear();
+    secondaryParticles.clear();
+    burstPattern = PATTERN_DEFAULT;
+    mainParticle = Particle(&trails, rng.split(), startX, startY, startVx,
+                            startVy, newColor);
+    color = newColor;
+    hasBurst = false;
+    burstSounded = false;
   }
 
   // check if main particle is out of the canvas after falling (to remove)
   bool hasReachedBottom() const { return mainParticle.getY() > HEIGHT; }
 
-  // updates the firework's physics and visual properties
-  void update() {
-    mainParticle.update();
+  // returns the burst sound once, after the firework has burst, and null
+  // otherwise. sound is not thread-safe, so the caller plays it on the thread
+  // that owns the sound player
+  SharedSound *takeBurstSound() {
+    if (hasBurst && !burstSounded) {
+      burstSounded = true;
+      return burstSound.get();
+    }
+    return nullptr;
+  }
+
+  // updates the firework's physics and visual properties within the
+  // particle budget of quality. touches nothing outside the firework, so
+  // fireworks can be updated in parallel
+  void update(const QualitySettings &quality) {
+    trails.setLimit(quality.maxTrail);
+    mainParticle.update<false, PATTERN_DEFAULT>(secondaryParticles, quality);
     if (!hasBurst && mainParticle.reachedPeak()) {
-      player.PlayOneShot(burstSound);
-      int choice = rand() % 4;
+      int choice = rng.next() % 4;
       switch (choice) {
       case 0:
         burst(); // normal
@@ -298,14 +1207,55 @@ public:
       }
       hasBurst = true;
     }
+    switch (burstPattern) {
+    case PATTERN_DEFAULT:
+      updateBurst<PATTERN_DEFAULT>(quality);
+      break;
+    case PATTERN_CHRYSANTHEMUM:
+      updateBurst<PATTERN_CHRYSANTHEMUM>(quality);
+      break;
+    case PATTERN_SPIRAL:
+      updateBurst<PATTERN_SPIRAL>(quality);
+      break;
+    case PATTERN_TWICE:
+      updateBurst<PATTERN_TWICE>(quality);
+      break;
+    }
+    // secondary particles burst once, with the default pattern
+    for (auto &particle : secondaryParticles) {
+      particle.update<true, PATTERN_DEFAULT>(secondaryParticles, quality);
+    }
+    trails.update();
+  }
+
+  // draws the head of every particle that leaves a trail into the
+  // accumulation buffer, matching the samples update() gives the TrailPool
+  void depositTrails(TrailAccumulator &accumulation) const {
+    if (!hasBurst) {
+      accumulation.deposit(mainParticle.getX(), mainParticle.getY(),
+                           mainParticle.getColor());
+    }
+    for (const auto &particle : burstParticles) {
+      accumulation.deposit(particle.getX(), particle.getY(),
+                           particle.getColor());
+    }
+    for (const auto &particle : secondaryParticles) {
+      accumulation.deposit(particle.getX(), particle.getY(),
+                           particle.getColor());
+    }
+  }
+
+  // updates the burst particles with the kernel of their pattern
+  template <int Pattern> void updateBurst(const QualitySettings &quality) {
     for (auto &particle : burstParticles) {
-      particle.update();
+      particle.update<true, Pattern>(secondaryParticles, quality);
     }
   }
 
   // creates a burst with numParticles and initialSpeed
   void createBurst(int numParticles, double initialSpeed,
-                   int burstPattern = PATTERN_DEFAULT) {
+                   int pattern = PATTERN_DEFAULT) {
+    burstPattern = pattern;
     double dtheta = 2 * PI / float(numParticles);
 
     // these particles are brighter than the main particle
@@ -316,12 +1266,13 @@ public:
     // create burst particles
     for (int i = 0; i < numParticles; ++i) {
       double angle =
-          i * dtheta + randRange(-BURST_RAND, BURST_RAND) * PI / 180.0f;
+          i * dtheta + randRange(rng, -BURST_RAND, BURST_RAND) * PI / 180.0f;
       double vx = initialSpeed * cos(angle);
       double vy = initialSpeed * sin(angle);
 
-      Particle burstParticle(mainParticle.getX(), mainParticle.getY(), vx, vy,
-                             Color(burstR, burstG, burstB), true, burstPattern);
+      Particle burstParticle(&trails, rng.split(), mainParticle.getX(),
+                             mainParticle.getY(), vx, vy,
+                             Color(burstR, burstG, burstB), true);
       burstParticles.push_back(burstParticle);
     }
   }
@@ -330,77 +1281,1894 @@ public:
   void burst() { createBurst(12, 1.0, PATTERN_DEFAULT); }
 
   // chrysanthemum burst (second burst write after first at center)
-  void burstChrysanthemum() {
-    createBurst(12, 1.0, PATTERN_CHRYSANTHEMUM);
-    for (auto &particle : burstParticles) {
-      particle.scheduleBurst();
-    }
-  }
+  void burstChrysanthemum() { createBurst(12, 1.0, PATTERN_CHRYSANTHEMUM); }
 
   // dual delayed burst
-  void burstTwice() {
-    createBurst(12, 1.0, PATTERN_TWICE);
-    for (auto &particle : burstParticles) {
-      particle.scheduleBurst();
-    }
-  }
+  void burstTwice() { createBurst(12, 1.0, PATTERN_TWICE); }
 
   // spiral burst
   void burstSpiral() { createBurst(12, 1.0, PATTERN_SPIRAL); }
 
-  // draws the all particles of the firework
-  void draw() {
-    mainParticle.draw();
+  // draws the all particles of the firework, interpolated alpha of the way
+  // between the last two updates
+  void draw(RenderBatch &batch, double alpha) const {
+    trails.draw(batch);
+    mainParticle.draw(batch, alpha);
     for (auto &particle : burstParticles) {
-      particle.draw();
+      particle.draw(batch, alpha);
+    }
+    for (auto &particle : secondaryParticles) {
+      particle.draw(batch, alpha);
     }
   }
 };
 
-class Star {
+// handle to a firework in a FireworkPool. the generation tells a live firework
+// apart from a later one that reuses the same slot
+struct FireworkHandle {
+  int slot;                // slot of the firework in the pool
+  unsigned int generation; // generation of the slot when the handle was made
+};
+
+// slab of fireworks that are reused instead of being deleted, so launching and
+// removing shells does not allocate once the pool has warmed up. live fireworks
+// are kept densely packed and removed by swapping with the last one
+class FireworkPool {
 private:
-  double x, y;        // position of star
-  float a;            // brightness of star
-  float twinkleSpeed; // speed of a oscillation
+  // a firework and its bookkeeping
+  struct Slot {
+    unique_ptr<Firework> firework; // allocated on first use, then reused
+    unsigned int generation;       // incremented every time the slot is freed
+    int activeIndex;               // position in active, or -1 when free
+  };
+
+  vector<Slot> slots;     // every firework ever allocated
+  vector<int> freeSlots;  // slots available for reuse
+  vector<int> active;     // slots of the live fireworks, in no particular order
+  SoundCache &sounds;     // sound cache passed to new fireworks
 
 public:
-  Star(double x, double y, float a) : x(x), y(y), a(a) {
-    twinkleSpeed = randRange(-0.01, 0.01); // random speed between [-0.01, 0.01]
+  explicit FireworkPool(SoundCache &sounds) : sounds(sounds) {}
+
+  // number of live fireworks
+  size_t size() const { return active.size(); }
+
+  // i-th live firework, for iteration
+  Firework &operator[](size_t i) { return *slots[active[i]].firework; }
+  const Firework &operator[](size_t i) const {
+    return *slots[active[i]].firework;
   }
 
-  // update a for twinkle effect
-  void update() {
-    a += twinkleSpeed;
-    if (a > 1 || a < 0) {
-      twinkleSpeed *= -1;
+  // handle of the i-th live firework
+  FireworkHandle handleAt(size_t i) const {
+    FireworkHandle handle = {active[i], slots[active[i]].generation};
+    return handle;
+  }
+
+  // returns the firework of a handle, or nullptr once it has been released
+  Firework *get(FireworkHandle handle) {
+    Slot &slot = slots[handle.slot];
+    if (slot.generation != handle.generation || slot.activeIndex < 0) {
+      return nullptr;
     }
+    return slot.firework.get();
   }
 
-  // draws the star
-  void draw() const {
-    glColor4f(1.0, 1.0, 1.0, a); // white color
-    glBegin(GL_POINTS);
-    glVertex2d(x, y);
-    glEnd();
+  // launches a firework, reusing a released one when possible
+  FireworkHandle launch(double startX, double startY, double startVx,
+                        double startVy, Color color, Pcg32 stream) {
+    int index;
+    if (!freeSlots.empty()) {
+      index = freeSlots.back();
+      freeSlots.pop_back();
+      slots[index].firework->relaunch(startX, startY, startVx, startVy, color,
+                                      stream);
+    } else {
+      index = int(slots.size());
+      Slot slot;
+      slot.firework.reset(new Firework(startX, startY, startVx, startVy, color,
+                                       stream, sounds));
+      slot.generation = 0;
+      slot.activeIndex = -1;
+      slots.push_back(move(slot));
+    }
+    slots[index].activeIndex = int(active.size());
+    active.push_back(index);
+    FireworkHandle handle = {index, slots[index].generation};
+    return handle;
+  }
+
+  // returns a firework to the pool. the last live firework takes its place,
+  // so releasing while iterating must not advance past the current index
+  void release(FireworkHandle handle) {
+    if (get(handle) == nullptr) {
+      return;
+    }
+    Slot &slot = slots[handle.slot];
+    const int last = active.back();
+    active[slot.activeIndex] = last;
+    slots[last].activeIndex = slot.activeIndex;
+    active.pop_back();
+    slot.activeIndex = -1;
+    ++slot.generation;
+    freeSlots.push_back(handle.slot);
   }
 };
 
-class ShootingStar {
+// work-stealing task scheduler. parallelFor splits a loop into one task per
+// index and deals them out to per-thread queues; each thread takes tasks from
+// the back of its own queue and, when it runs dry, steals from the front of
+// the others, so a few heavy fireworks do not leave the other cores idle. the
+// calling thread works as thread 0
+class TaskScheduler {
 private:
-  double x, y;      // position of the shooting star
-  double vx, vy;    // velocity
-  float brightness; // brightness of the star
+  // a range of loop indices [begin, end) of the loop started as epoch
+  struct Task {
+    size_t begin, end;
+    unsigned int epoch;
+  };
+
+  // task queue of one thread
+  struct Worker {
+    mutex lock;
+    deque<Task> tasks;
+  };
+
+  vector<unique_ptr<Worker>> workers; // task queues, one per thread
+  vector<thread> threads;             // helper threads 1 .. n-1
+  const function<void(size_t)> *body = nullptr; // loop body being run
+  atomic<size_t> pending;             // indices not yet finished
+  mutex wakeLock;                     // guards epoch and stopping
+  condition_variable wake;            // signals a new loop or shutdown
+  atomic<unsigned int> epoch;         // number of loops started
+  bool stopping = false;              // set when the scheduler shuts down
+
+  // tasks of other loops are left alone, so a helper still finishing the
+  // previous loop cannot run them with the wrong body
+  bool pop(int id, unsigned int loop, Task &task) {
+    Worker &worker = *workers[id];
+    lock_guard<mutex> lock(worker.lock);
+    if (worker.tasks.empty() || worker.tasks.back().epoch != loop) {
+      return false;
+    }
+    task = worker.tasks.back();
+    worker.tasks.pop_back();
+    return true;
+  }
 
-public:
-  ShootingStar(double startX, double startY, double endX, double endY) {
-    x = startX;
-    y = startY;
-    double dx = endX - startX;
-    double dy = endY - startY;
-    double length = sqrt(dx * dx + dy * dy); // estimate of speed needed
-    vx = dx / length;
-    vy = dy / length;
-    brightness = 1.0f;
+  bool steal(int id, unsigned int loop, Task &task) {
+    for (size_t k = 1; k < workers.size(); ++k) {
+      Worker &victim = *workers[(id + k) % workers.size()];
+      lock_guard<mutex> lock(victim.lock);
+      if (!victim.tasks.empty() && victim.tasks.front().epoch == loop) {
+        task = victim.tasks.front();
+        victim.tasks.pop_front();
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // runs tasks of the given loop until every index of it has finished, or
+  // until a newer loop has started
+  void work(int id, unsigned int loop) {
+    Task task;
+    while (pending.load() > 0 && epoch.load() == loop) {
+      if (pop(id, loop, task) || steal(id, loop, task)) {
+        for (size_t i = task.begin; i < task.end; ++i) {
+          (*body)(i);
+        }
+        pending -= task.end - task.begin;
+      } else {
+        this_thread::yield();
+      }
+    }
+  }
+
+  void threadMain(int id) {
+    unsigned int seen = 0;
+    while (true) {
+      {
+        unique_lock<mutex> lock(wakeLock);
+        wake.wait(lock, [&] { return stopping || epoch != seen; });
+        if (stopping) {
+          return;
+        }
+        seen = epoch;
+      }
+      work(id, seen);
+    }
+  }
+
+public:
+  explicit TaskScheduler(int numThreads) : pending(0), epoch(0) {
+    numThreads = max(numThreads, 1);
+    for (int i = 0; i < numThreads; ++i) {
+      workers.push_back(unique_ptr<Worker>(new Worker));
+    }
+    for (int i = 1; i < numThreads; ++i) {
+      threads.push_back(thread(&TaskScheduler::threadMain, this, i));
+    }
+  }
+
+  ~TaskScheduler() {
+    {
+      lock_guard<mutex> lock(wakeLock);
+      stopping = true;
+    }
+    wake.notify_all();
+    for (auto &t : threads) {
+      t.join();
+    }
+  }
+
+  int getNumThreads() const { return int(workers.size()); }
+
+  // calls loopBody(i) for every i in [0, n) and returns when all are done
+  void parallelFor(size_t n, const function<void(size_t)> &loopBody) {
+    if (workers.size() == 1 || n <= 1) {
+      for (size_t i = 0; i < n; ++i) {
+        loopBody(i);
+      }
+      return;
+    }
+    // the loop is published before its tasks are queued, so any task a
+    // thread can take already has its body and is counted in pending
+    unsigned int loop;
+    {
+      lock_guard<mutex> lock(wakeLock);
+      body = &loopBody;
+      pending = n;
+      loop = ++epoch;
+    }
+    for (size_t i = 0; i < n; ++i) {
+      Worker &worker = *workers[i % workers.size()];
+      lock_guard<mutex> lock(worker.lock);
+      Task task = {i, i + 1, loop};
+      worker.tasks.push_back(task);
+    }
+    wake.notify_all();
+    work(0, loop);
+  }
+};
+
+// lock-free queue between exactly one producer thread and one consumer
+// thread, with a fixed number of entries. push fails instead of waiting when
+// the queue is full
+template <typename T> class SpscQueue {
+private:
+  vector<T> entries;    // ring of capacity + 1 entries, one always empty
+  atomic<size_t> head;  // next entry to pop, written by the consumer
+  atomic<size_t> tail;  // next entry to push, written by the producer
+
+public:
+  explicit SpscQueue(size_t capacity)
+      : entries(capacity + 1), head(0), tail(0) {}
+
+  // adds a value; returns false when the queue is full
+  bool push(const T &value) {
+    const size_t t = tail.load(memory_order_relaxed);
+    const size_t next = (t + 1) % entries.size();
+    if (next == head.load(memory_order_acquire)) {
+      return false;
+    }
+    entries[t] = value;
+    tail.store(next, memory_order_release);
+    return true;
+  }
+
+  // takes the oldest value; returns false when the queue is empty
+  bool pop(T &value) {
+    const size_t h = head.load(memory_order_relaxed);
+    if (h == tail.load(memory_order_acquire)) {
+      return false;
+    }
+    value = entries[h];
+    head.store((h + 1) % entries.size(), memory_order_release);
+    return true;
+  }
+};
+
+// hands the latest value from one producer thread to one consumer thread
+// without locks or waiting. the producer fills back() and publishes it; the
+// consumer calls update() and reads front(). the third buffer sits in the
+// middle, so neither side ever touches the buffer the other one is using, and
+// values the consumer had no time for are skipped
+template <typename T> class TripleBuffer {
+private:
+  static const int FRESH = 4; // set in middle when it holds an unread value
+
+  T buffers[3];
+  int backIndex = 0;  // buffer the producer writes, producer only
+  atomic<int> middle; // buffer in between, plus FRESH
+  int frontIndex = 2; // buffer the consumer reads, consumer only
+
+public:
+  TripleBuffer() : middle(1) {}
+
+  T &back() { return buffers[backIndex]; }
+
+  // swaps the filled back buffer into the middle for the consumer
+  void publish() {
+    backIndex = middle.exchange(backIndex | FRESH, memory_order_acq_rel) & 3;
+  }
+
+  // takes the latest published value, if there is a new one; returns whether
+  // front() changed
+  bool update() {
+    if ((middle.load(memory_order_relaxed) & FRESH) == 0) {
+      return false;
+    }
+    frontIndex = middle.exchange(frontIndex, memory_order_acq_rel) & 3;
+    return true;
+  }
+
+  const T &front() const { return buffers[frontIndex]; }
+};
+
+// coverage of a pixel by a smooth point of the given radius, where (dx, dy)
+// is the distance from the center of the point to the center of the pixel:
+// 1 inside the disc, falling off linearly over the pixel at its edge
+inline float pointCoverage(float dx, float dy, float radius) {
+  return min(max(radius + 0.5f - sqrtf(dx * dx + dy * dy), 0.0f), 1.0f);
+}
+
+// blends count RGBA8 pixels from dst with color[0..2] at alpha color[3] times
+// the coverage of each pixel, like the SoftwareRenderer's blend()
+typedef void (*StampKernel)(unsigned char *dst, const float *coverage,
+                            int count, const float color[4]);
+
+void stampKernelScalar(unsigned char *dst, const float *coverage, int count,
+                       const float color[4]) {
+  for (int i = 0; i < count; ++i, dst += 4) {
+    const float a = min(max(color[3] * coverage[i], 0.0f), 1.0f);
+    const float keep = (1.0f - a) / 255.0f;
+    dst[0] = toByte(color[0] * a + dst[0] * keep);
+    dst[1] = toByte(color[1] * a + dst[1] * keep);
+    dst[2] = toByte(color[2] * a + dst[2] * keep);
+    dst[3] = toByte(a * a + dst[3] * keep);
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// blends two pixels at a time, one in each 128-bit lane, with the same
+// operations in the same order as the scalar kernel
+__attribute__((target("avx2"))) void
+stampKernelAvx2(unsigned char *dst, const float *coverage, int count,
+                const float color[4]) {
+  const __m256 rgb = _mm256_setr_ps(color[0], color[1], color[2], 0, color[0],
+                                    color[1], color[2], 0);
+  const __m256 alpha = _mm256_set1_ps(color[3]);
+  const __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.0f);
+  const __m256 scale = _mm256_set1_ps(255.0f), half = _mm256_set1_ps(0.5f);
+  int i = 0;
+  for (; i + 2 <= count; i += 2, dst += 8) {
+    const __m256 cover = _mm256_setr_m128(_mm_set1_ps(coverage[i]),
+                                          _mm_set1_ps(coverage[i + 1]));
+    const __m256 a =
+        _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(alpha, cover), zero), one);
+    const __m256 keep = _mm256_div_ps(_mm256_sub_ps(one, a), scale);
+    const __m256 src = _mm256_blend_ps(rgb, a, 0x88); // alpha goes in as a
+    const __m256 old = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(
+        _mm_loadl_epi64(reinterpret_cast<const __m128i *>(dst))));
+    __m256 v = _mm256_add_ps(_mm256_mul_ps(src, a), _mm256_mul_ps(old, keep));
+    v = _mm256_min_ps(_mm256_max_ps(v, zero), one);
+    v = _mm256_add_ps(_mm256_mul_ps(v, scale), half);
+    const __m256i q = _mm256_cvttps_epi32(v);
+    const __m128i words = _mm_packus_epi32(_mm256_castsi256_si128(q),
+                                           _mm256_extracti128_si256(q, 1));
+    _mm_storel_epi64(reinterpret_cast<__m128i *>(dst),
+                     _mm_packus_epi16(words, words));
+  }
+  _mm256_zeroupper(); // the scalar tail is SSE code
+  stampKernelScalar(dst, coverage + i, count - i, color);
+}
+#endif
+
+StampKernel pickStampKernel() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return stampKernelAvx2;
+  }
+#endif
+  return stampKernelScalar;
+}
+
+StampKernel getStampKernel() {
+  static const StampKernel kernel = pickStampKernel();
+  return kernel;
+}
+
+// precomputed coverage of a smooth point of one size at each of the
+// STAMP_SUBPIXELS x STAMP_SUBPIXELS sub-pixel positions of its center. drawing
+// a point is then a lookup and a blend of the stamp, instead of a square root
+// for every pixel it might touch
+class PointStamps {
+public:
+  // coverage of the pixels [x0, x0 + wid) x [y0, y0 + hei) around the pixel
+  // the center of the point is in, rows from top to bottom
+  struct Stamp {
+    int x0, y0, wid, hei;
+    vector<float> coverage;
+  };
+
+private:
+  float size;          // diameter of the point in pixels
+  vector<Stamp> stamps; // stamps by sub-pixel row, then column
+
+public:
+  explicit PointStamps(float size) : size(size) {
+    const float radius = size * 0.5f;
+    const int reach = int(ceilf(radius + 1.0f)); // pixels that may be touched
+    for (int sy = 0; sy < STAMP_SUBPIXELS; ++sy) {
+      for (int sx = 0; sx < STAMP_SUBPIXELS; ++sx) {
+        // center of the point relative to the corner of its pixel
+        const float cx = float(sx) / STAMP_SUBPIXELS;
+        const float cy = float(sy) / STAMP_SUBPIXELS;
+        // keep only the rows and columns the point covers
+        int x0 = reach, x1 = -reach, y0 = reach, y1 = -reach;
+        for (int y = -reach; y <= reach; ++y) {
+          for (int x = -reach; x <= reach; ++x) {
+            if (pointCoverage(x + 0.5f - cx, y + 0.5f - cy, radius) > 0) {
+              x0 = min(x0, x), x1 = max(x1, x + 1);
+              y0 = min(y0, y), y1 = max(y1, y + 1);
+            }
+          }
+        }
+        Stamp stamp;
+        stamp.x0 = x0;
+        stamp.y0 = y0;
+        stamp.wid = max(x1 - x0, 0);
+        stamp.hei = max(y1 - y0, 0);
+        for (int y = y0; y < y1; ++y) {
+          for (int x = x0; x < x1; ++x) {
+            stamp.coverage.push_back(
+                pointCoverage(x + 0.5f - cx, y + 0.5f - cy, radius));
+          }
+        }
+        stamps.push_back(move(stamp));
+      }
+    }
+  }
+
+  float getSize() const { return size; }
+
+  // stamp of a point centered at (x, y); sets (px, py) to the pixel its
+  // coverage starts at
+  const Stamp &find(float x, float y, int &px, int &py) const {
+    const int qx = int(floorf(x * STAMP_SUBPIXELS + 0.5f));
+    const int qy = int(floorf(y * STAMP_SUBPIXELS + 0.5f));
+    const int ix = int(floorf(float(qx) / STAMP_SUBPIXELS));
+    const int iy = int(floorf(float(qy) / STAMP_SUBPIXELS));
+    const Stamp &stamp = stamps[(qy - iy * STAMP_SUBPIXELS) * STAMP_SUBPIXELS +
+                                qx - ix * STAMP_SUBPIXELS];
+    px = ix + stamp.x0;
+    py = iy + stamp.y0;
+    return stamp;
+  }
+};
+
+// sums taps input rows of bytes into dst[0, count), row k with weights[k]
+typedef void (*ResampleColumnKernel)(const unsigned char *const rows[],
+                                     const float *weights, int taps,
+                                     float *dst, int count);
+// resizes one row of RGBA floats into dstWid RGBA8 pixels: pixel x is the sum
+// of weights[x * taps + k] times input pixel first[x] + k
+typedef void (*ResampleRowKernel)(const float *src, const int *first,
+                                  const float *weights, int taps,
+                                  unsigned char *dst, int dstWid);
+
+void resampleColumnScalar(const unsigned char *const rows[],
+                          const float *weights, int taps, float *dst,
+                          int count) {
+  for (int i = 0; i < count; ++i) {
+    float sum = 0;
+    for (int k = 0; k < taps; ++k) {
+      sum += weights[k] * rows[k][i];
+    }
+    dst[i] = sum;
+  }
+}
+
+void resampleRowScalar(const float *src, const int *first,
+                       const float *weights, int taps, unsigned char *dst,
+                       int dstWid) {
+  for (int x = 0; x < dstWid; ++x, weights += taps, dst += 4) {
+    const float *in = src + size_t(first[x]) * 4;
+    float sum[4] = {0, 0, 0, 0};
+    for (int k = 0; k < taps; ++k) {
+      for (int c = 0; c < 4; ++c) {
+        sum[c] += weights[k] * in[k * 4 + c];
+      }
+    }
+    for (int c = 0; c < 4; ++c) {
+      dst[c] = (unsigned char)min(max(sum[c] + 0.5f, 0.0f), 255.0f);
+    }
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// 8 bytes of every input row at a time, summed in a register
+__attribute__((target("avx2,fma"))) void
+resampleColumnAvx2(const unsigned char *const rows[], const float *weights,
+                   int taps, float *dst, int count) {
+  int i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256 sum = _mm256_setzero_ps();
+    for (int k = 0; k < taps; ++k) {
+      const __m256 bytes = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(
+          _mm_loadl_epi64(reinterpret_cast<const __m128i *>(rows[k] + i))));
+      sum = _mm256_fmadd_ps(_mm256_set1_ps(weights[k]), bytes, sum);
+    }
+    _mm256_storeu_ps(dst + i, sum);
+  }
+  _mm256_zeroupper(); // the scalar tail is SSE code
+  resampleColumnScalar(rows, weights, taps, dst + i, count - i);
+}
+
+// the four channels of a pixel at a time
+__attribute__((target("avx2,fma"))) void
+resampleRowAvx2(const float *src, const int *first, const float *weights,
+                int taps, unsigned char *dst, int dstWid) {
+  const __m128 zero = _mm_setzero_ps(), top = _mm_set1_ps(255.0f);
+  const __m128 half = _mm_set1_ps(0.5f);
+  for (int x = 0; x < dstWid; ++x, weights += taps, dst += 4) {
+    const float *in = src + size_t(first[x]) * 4;
+    __m128 sum = _mm_setzero_ps();
+    for (int k = 0; k < taps; ++k) {
+      sum = _mm_fmadd_ps(_mm_set1_ps(weights[k]), _mm_loadu_ps(in + k * 4),
+                         sum);
+    }
+    sum = _mm_min_ps(_mm_max_ps(_mm_add_ps(sum, half), zero), top);
+    const __m128i words =
+        _mm_packus_epi32(_mm_cvttps_epi32(sum), _mm_setzero_si128());
+    const int pixel = _mm_cvtsi128_si32(_mm_packus_epi16(words, words));
+    memcpy(dst, &pixel, 4);
+  }
+}
+#endif
+
+// the widest resampling kernels the CPU supports
+struct ResampleKernels {
+  ResampleColumnKernel column;
+  ResampleRowKernel row;
+
+  static ResampleKernels pick() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+      return ResampleKernels{resampleColumnAvx2, resampleRowAvx2};
+    }
+#endif
+    return ResampleKernels{resampleColumnScalar, resampleRowScalar};
+  }
+
+  static const ResampleKernels &get() {
+    static const ResampleKernels kernels = pick();
+    return kernels;
+  }
+};
+
+// filters a Resampler can use
+enum ResampleFilter {
+  FILTER_BOX,    // average of the pixels under each output pixel
+  FILTER_LANCZOS // LANCZOS_LOBES-lobed windowed sinc, sharper
+};
+
+// resizes RGBA8 images with a separable filter. every output pixel is a
+// weighted sum of the input pixels under the filter, first down the columns
+// into a float row, then along it. the weights only depend on the sizes, so
+// they are computed once and reused for every frame of the same size. output
+// rows are resized in bands of RESAMPLE_BAND in parallel, each band with its
+// own float row
+class Resampler {
+private:
+  // weights of every output pixel along one axis: output i is the sum of
+  // weights[i * taps + k] times input first[i] + k
+  struct Axis {
+    int taps = 0;
+    vector<int> first;
+    vector<float> weights;
+  };
+
+  TaskScheduler *scheduler;     // resizes the bands, null for one at a time
+  ResampleFilter filter;        // filter of the weights
+  int srcWid = 0, srcHei = 0;   // sizes the weights were made for
+  int dstWid = 0, dstHei = 0;
+  Axis columns, rows;           // weights along each axis
+  vector<vector<float>> scratch; // float row of each band
+
+  static float sinc(float x) {
+    if (fabsf(x) < 1e-6f) {
+      return 1.0f;
+    }
+    const float px = float(PI) * x;
+    return sinf(px) / px;
+  }
+
+  // filter weight at distance t from the center, in output pixels
+  float weight(float t) const {
+    if (filter == FILTER_BOX) {
+      return fabsf(t) <= 0.5f ? 1.0f : 0.0f;
+    }
+    return fabsf(t) < LANCZOS_LOBES ? sinc(t) * sinc(t / LANCZOS_LOBES) : 0;
+  }
+
+  // weights of srcSize pixels resized to dstSize. the filter widens when
+  // shrinking, so it covers every input pixel, and pixels past the edges are
+  // the edge pixels
+  Axis makeAxis(int srcSize, int dstSize) const {
+    const float scale = float(srcSize) / dstSize;
+    const float stretch = max(scale, 1.0f); // filter width in input pixels
+    const float radius =
+        (filter == FILTER_BOX ? 0.5f : float(LANCZOS_LOBES)) * stretch;
+    vector<vector<float>> dense(dstSize); // weights from first, unpadded
+    Axis axis;
+    axis.first.resize(dstSize);
+    for (int i = 0; i < dstSize; ++i) {
+      const float center = (i + 0.5f) * scale;
+      const int lo = int(floorf(center - radius));
+      const int hi = int(ceilf(center + radius));
+      const int first = min(max(lo, 0), srcSize - 1);
+      const int last = min(max(hi, 0), srcSize - 1);
+      vector<float> &w = dense[i];
+      w.assign(last - first + 1, 0.0f);
+      float sum = 0;
+      for (int j = lo; j <= hi; ++j) {
+        const float v = weight((j + 0.5f - center) / stretch);
+        w[min(max(j, 0), srcSize - 1) - first] += v;
+        sum += v;
+      }
+      for (auto &v : w) {
+        v /= sum;
+      }
+      // leave out the pixels the filter gives no weight
+      size_t skip = 0;
+      while (skip + 1 < w.size() && w[skip] == 0) {
+        ++skip;
+      }
+      while (w.size() > skip + 1 && w.back() == 0) {
+        w.pop_back();
+      }
+      w.erase(w.begin(), w.begin() + skip);
+      axis.first[i] = first + int(skip);
+      axis.taps = max(axis.taps, int(w.size()));
+    }
+    // pad every pixel to the same number of taps, staying inside the image
+    axis.weights.assign(size_t(dstSize) * axis.taps, 0.0f);
+    for (int i = 0; i < dstSize; ++i) {
+      const int first = min(axis.first[i], srcSize - axis.taps);
+      const int shift = axis.first[i] - first;
+      for (size_t k = 0; k < dense[i].size(); ++k) {
+        axis.weights[size_t(i) * axis.taps + shift + k] = dense[i][k];
+      }
+      axis.first[i] = first;
+    }
+    return axis;
+  }
+
+  void resizeBand(size_t band, const unsigned char src[],
+                  unsigned char dst[]) {
+    const ResampleKernels &kernels = ResampleKernels::get();
+    vector<float> &row = scratch[band];
+    vector<const unsigned char *> lines(rows.taps); // rows under the filter
+    const int y0 = int(band) * RESAMPLE_BAND;
+    for (int y = y0; y < min(y0 + RESAMPLE_BAND, dstHei); ++y) {
+      for (int k = 0; k < rows.taps; ++k) {
+        lines[k] = &src[size_t(rows.first[y] + k) * srcWid * 4];
+      }
+      kernels.column(lines.data(), &rows.weights[size_t(y) * rows.taps],
+                     rows.taps, row.data(), srcWid * 4);
+      kernels.row(row.data(), columns.first.data(), columns.weights.data(),
+                  columns.taps, &dst[size_t(y) * dstWid * 4], dstWid);
+    }
+  }
+
+public:
+  Resampler(TaskScheduler *scheduler, ResampleFilter filter)
+      : scheduler(scheduler), filter(filter) {}
+
+  // resizes src (srcWid x srcHei) into dst (dstWid x dstHei)
+  void resize(const unsigned char src[], int newSrcWid, int newSrcHei,
+              unsigned char dst[], int newDstWid, int newDstHei) {
+    if (newSrcWid != srcWid || newSrcHei != srcHei || newDstWid != dstWid ||
+        newDstHei != dstHei) {
+      srcWid = newSrcWid;
+      srcHei = newSrcHei;
+      dstWid = newDstWid;
+      dstHei = newDstHei;
+      columns = makeAxis(srcWid, dstWid);
+      rows = makeAxis(srcHei, dstHei);
+      scratch.assign((dstHei + RESAMPLE_BAND - 1) / RESAMPLE_BAND,
+                     vector<float>(size_t(srcWid) * 4));
+    }
+    const function<void(size_t)> body = [&](size_t band) {
+      resizeBand(band, src, dst);
+    };
+    if (scheduler != nullptr) {
+      scheduler->parallelFor(scratch.size(), body);
+    } else {
+      for (size_t band = 0; band < scratch.size(); ++band) {
+        body(band);
+      }
+    }
+  }
+};
+
+// rasterizes on the CPU into an RGBA framebuffer in memory, so the show can
+// be drawn without a GPU or a window. follows the OpenGL rules for square
+// points and one pixel lines. rows are stored from top to bottom.
+// with a scheduler, primitives are recorded during the frame, binned into
+// TILE_SIZE square tiles, and the tiles are rasterized in parallel by
+// endFrame(). each tile draws its primitives in submission order, so the
+// result is the same as drawing them one by one.
+// the background is rendered once into a buffer that every frame is copied
+// from, and the foreground is kept as runs of pixels per row, so opaque runs
+// are copied and only partly transparent pixels are blended.
+// smooth points are stamped from PointStamps tables built once per size.
+// with supersampling everything is drawn into a canvas supersample times the
+// size of the frame across and down, which endFrame() filters down into the
+// frame
+class SoftwareRenderer : public Renderer {
+public:
+  // what one tile drew in the last tiled frame
+  struct TileStats {
+    int points = 0;    // points touching the tile
+    int lines = 0;     // lines whose bounds touch the tile
+    int fills = 0;     // foregrounds touching the tile
+    double ms = 0;     // time spent rasterizing the tile
+  };
+
+private:
+  enum CommandType { POINT, STAMP, LINE, FOREGROUND, LAYER };
+
+  // one recorded primitive
+  struct Command {
+    CommandType type;
+    int size;     // point width in pixels, or stamps of a smooth point
+    size_t first; // first vertex
+  };
+
+  // pixels [x0, x1) of one framebuffer row of the foreground
+  struct Run {
+    int x0, x1;
+    const unsigned char *rgba; // foreground pixel at x0
+    bool opaque;               // every pixel has alpha 255
+  };
+
+  // pixels [x0, x1) x [y0, y1) that a primitive may touch
+  struct Rect {
+    int x0, y0, x1, y1;
+  };
+
+  int outWid, outHei;          // frame size in pixels
+  int supersample;             // canvas pixels per frame pixel, across
+  int wid, hei;                // canvas size in pixels
+  float scale;                 // canvas pixels per world unit
+  vector<unsigned char> rgba;  // canvas, 4 bytes per pixel
+  vector<unsigned char> frame; // canvas filtered down, when supersampling
+  Resampler downsampler;       // filters the canvas into the frame
+  TaskScheduler *scheduler;    // rasterizes the tiles, null to draw at once
+  int tilesX, tilesY;          // number of tiles across and down
+  vector<Command> commands;    // primitives of the frame, in order
+  vector<BatchVertex> vertices; // vertices of the recorded primitives
+  Color top = Color(0, 0, 0);  // background colors
+  Color bottom = Color(0, 0, 0);
+  vector<unsigned char> background; // background, copied into every frame
+  bool backgroundValid = false; // cleared when the background must be redrawn
+  vector<unsigned char> foreground; // foreground scaled to the canvas
+  vector<Run> runs;            // visible foreground pixels, row by row
+  vector<size_t> rowRuns;      // first run of each row, and the end
+  Rect foregroundBounds = {0, 0, 0, 0}; // pixels covered by the runs
+  const float *layer[4] = {};  // planes of the layer of the frame
+  int layerWid = 0, layerHei = 0; // size of the layer
+  vector<int> layerColumns;    // layer column of every canvas column
+  bool smoothPoints = false;   // stamp points as discs instead of squares
+  vector<unique_ptr<PointStamps>> stamps; // smooth point stamps by size
+  vector<vector<unsigned>> bins; // commands touching each tile, in order
+  vector<TileStats> stats;     // statistics of each tile
+
+  // blends a color in [0, 1] over pixel (px, py), which must be in bounds
+  void blend(int px, int py, float r, float g, float b, float a) {
+    unsigned char *dst = &rgba[(size_t(py) * wid + px) * 4];
+    a = min(max(a, 0.0f), 1.0f);
+    const float keep = (1.0f - a) / 255.0f;
+    dst[0] = toByte(r * a + dst[0] * keep);
+    dst[1] = toByte(g * a + dst[1] * keep);
+    dst[2] = toByte(b * a + dst[2] * keep);
+    dst[3] = toByte(a * a + dst[3] * keep);
+  }
+
+  static int pointWidth(float size) { return max(1, int(size + 0.5f)); }
+
+  // the vertex with its position in canvas pixels
+  BatchVertex toCanvas(BatchVertex v) const {
+    v.x *= scale;
+    v.y *= scale;
+    return v;
+  }
+
+  // first pixel covered by a point of the given width centered at v
+  static int pointStart(float v, int width) {
+    return int(floorf(v - width * 0.5f + 0.5f));
+  }
+
+  // draws the gradient over transparent black and keeps it as the background
+  void renderBackground() {
+    fill(rgba.begin(), rgba.end(), 0);
+    for (int py = 0; py < hei; ++py) {
+      const float t = (py + 0.5f) / hei; // sampled at the pixel center
+      const float r = top.getR() + (bottom.getR() - top.getR()) * t;
+      const float g = top.getG() + (bottom.getG() - top.getG()) * t;
+      const float b = top.getB() + (bottom.getB() - top.getB()) * t;
+      const float a = top.getA() + (bottom.getA() - top.getA()) * t;
+      for (int px = 0; px < wid; ++px) {
+        blend(px, py, r, g, b, a);
+      }
+    }
+    background = rgba;
+    backgroundValid = true;
+  }
+
+  // copies the background into the rows [y0, y1) and columns [x0, x1)
+  void copyBackground(const Rect &clip) {
+    for (int py = clip.y0; py < clip.y1; ++py) {
+      const size_t begin = (size_t(py) * wid + clip.x0) * 4;
+      const size_t end = (size_t(py) * wid + clip.x1) * 4;
+      copy(&background[begin], &background[end], &rgba[begin]);
+    }
+  }
+
+  // non-smooth points are squares of the rounded size
+  void rasterPoint(const BatchVertex &v, int width, const Rect &clip) {
+    const int x0 = pointStart(v.x, width), y0 = pointStart(v.y, width);
+    for (int py = max(y0, clip.y0); py < min(y0 + width, clip.y1); ++py) {
+      for (int px = max(x0, clip.x0); px < min(x0 + width, clip.x1); ++px) {
+        blend(px, py, v.r, v.g, v.b, v.a);
+      }
+    }
+  }
+
+  // smooth points blend their precomputed coverage row by row
+  void rasterStamp(const BatchVertex &v, const PointStamps &set,
+                   const Rect &clip) {
+    int x0, y0;
+    const PointStamps::Stamp &stamp = set.find(v.x, v.y, x0, y0);
+    const int left = max(x0, clip.x0), right = min(x0 + stamp.wid, clip.x1);
+    if (left >= right) {
+      return;
+    }
+    const float color[4] = {v.r, v.g, v.b, v.a};
+    const StampKernel kernel = getStampKernel();
+    for (int py = max(y0, clip.y0); py < min(y0 + stamp.hei, clip.y1); ++py) {
+      kernel(&rgba[(size_t(py) * wid + left) * 4],
+             &stamp.coverage[size_t(py - y0) * stamp.wid + left - x0],
+             right - left, color);
+    }
+  }
+
+  // index of the stamps of smooth points of the given size, made on first use
+  int findStamps(float size) {
+    for (size_t i = 0; i < stamps.size(); ++i) {
+      if (stamps[i]->getSize() == size) {
+        return int(i);
+      }
+    }
+    stamps.push_back(unique_ptr<PointStamps>(new PointStamps(size)));
+    return int(stamps.size()) - 1;
+  }
+
+  // draws the line from v0 to v1 in v0's color by stepping one pixel at a
+  // time along its longer axis (a DDA). the last pixel is left out like
+  // OpenGL, so that connected lines do not overlap
+  void rasterLine(const BatchVertex &v0, const BatchVertex &v1,
+                  const Rect &clip) {
+    const float dx = v1.x - v0.x, dy = v1.y - v0.y;
+    const int steps = int(max(fabs(dx), fabs(dy)) + 0.5f);
+    if (steps == 0) {
+      return;
+    }
+    const float sx = dx / steps, sy = dy / steps;
+    for (int i = 0; i < steps; ++i) {
+      const int px = int(floorf(v0.x + sx * i));
+      const int py = int(floorf(v0.y + sy * i));
+      if (clip.x0 <= px && px < clip.x1 && clip.y0 <= py && py < clip.y1) {
+        blend(px, py, v0.r, v0.g, v0.b, v0.a);
+      }
+    }
+  }
+
+  void rasterForeground(const Rect &clip) {
+    if (rowRuns.empty()) {
+      return;
+    }
+    for (int py = clip.y0; py < clip.y1; ++py) {
+      for (size_t i = rowRuns[py]; i < rowRuns[py + 1]; ++i) {
+        const Run &run = runs[i];
+        const int x0 = max(run.x0, clip.x0), x1 = min(run.x1, clip.x1);
+        if (x0 >= x1) {
+          continue;
+        }
+        const unsigned char *src = run.rgba + (x0 - run.x0) * 4;
+        if (run.opaque) {
+          // blending an opaque pixel gives the pixel itself
+          copy(src, src + (x1 - x0) * 4, &rgba[(size_t(py) * wid + x0) * 4]);
+          continue;
+        }
+        for (int px = x0; px < x1; ++px, src += 4) {
+          blend(px, py, src[0] / 255.0f, src[1] / 255.0f, src[2] / 255.0f,
+                src[3] / 255.0f);
+        }
+      }
+    }
+  }
+
+  // blends the premultiplied layer over the frame, taking the nearest layer
+  // pixel of every canvas pixel
+  void rasterLayer(const Rect &clip) {
+    for (int py = clip.y0; py < clip.y1; ++py) {
+      const size_t row = size_t(py) * layerHei / hei * layerWid;
+      for (int px = clip.x0; px < clip.x1; ++px) {
+        const size_t i = row + layerColumns[px];
+        const float a = min(layer[3][i], 1.0f);
+        if (a <= 0) {
+          continue; // nothing accumulated here
+        }
+        unsigned char *dst = &rgba[(size_t(py) * wid + px) * 4];
+        const float keep = (1.0f - a) / 255.0f;
+        dst[0] = toByte(layer[0][i] + dst[0] * keep);
+        dst[1] = toByte(layer[1][i] + dst[1] * keep);
+        dst[2] = toByte(layer[2][i] + dst[2] * keep);
+        dst[3] = toByte(a + dst[3] * keep);
+      }
+    }
+  }
+
+  void execute(const Command &command, const Rect &clip) {
+    switch (command.type) {
+    case POINT:
+      rasterPoint(vertices[command.first], command.size, clip);
+      break;
+    case STAMP:
+      rasterStamp(vertices[command.first], *stamps[command.size], clip);
+      break;
+    case LINE:
+      rasterLine(vertices[command.first], vertices[command.first + 1], clip);
+      break;
+    case FOREGROUND:
+      rasterForeground(clip);
+      break;
+    case LAYER:
+      rasterLayer(clip);
+      break;
+    }
+  }
+
+  // pixels the command may touch, clamped to the framebuffer
+  Rect bounds(const Command &command) const {
+    Rect r = {0, 0, wid, hei};
+    if (command.type == POINT) {
+      const BatchVertex &v = vertices[command.first];
+      r.x0 = pointStart(v.x, command.size);
+      r.y0 = pointStart(v.y, command.size);
+      r.x1 = r.x0 + command.size;
+      r.y1 = r.y0 + command.size;
+    } else if (command.type == STAMP) {
+      const BatchVertex &v = vertices[command.first];
+      const PointStamps::Stamp &stamp =
+          stamps[command.size]->find(v.x, v.y, r.x0, r.y0);
+      r.x1 = r.x0 + stamp.wid;
+      r.y1 = r.y0 + stamp.hei;
+    } else if (command.type == LINE) {
+      const BatchVertex &v0 = vertices[command.first];
+      const BatchVertex &v1 = vertices[command.first + 1];
+      r.x0 = int(floorf(min(v0.x, v1.x)));
+      r.y0 = int(floorf(min(v0.y, v1.y)));
+      r.x1 = int(floorf(max(v0.x, v1.x))) + 1;
+      r.y1 = int(floorf(max(v0.y, v1.y))) + 1;
+    } else if (command.type == FOREGROUND) {
+      r = foregroundBounds;
+    }
+    r.x0 = max(r.x0, 0);
+    r.y0 = max(r.y0, 0);
+    r.x1 = min(r.x1, wid);
+    r.y1 = min(r.y1, hei);
+    return r;
+  }
+
+  // draws the command now, or records it for endFrame
+  void submit(const Command &command) {
+    if (scheduler == nullptr) {
+      execute(command, Rect{0, 0, wid, hei});
+    } else {
+      commands.push_back(command);
+    }
+  }
+
+  void bin() {
+    for (auto &tile : bins) {
+      tile.clear();
+    }
+    for (size_t i = 0; i < commands.size(); ++i) {
+      const Rect r = bounds(commands[i]);
+      if (r.x0 >= r.x1 || r.y0 >= r.y1) {
+        continue; // off screen
+      }
+      for (int ty = r.y0 / TILE_SIZE; ty <= (r.y1 - 1) / TILE_SIZE; ++ty) {
+        for (int tx = r.x0 / TILE_SIZE; tx <= (r.x1 - 1) / TILE_SIZE; ++tx) {
+          bins[ty * tilesX + tx].push_back(unsigned(i));
+        }
+      }
+    }
+  }
+
+  void rasterTile(size_t index) {
+    auto start = chrono::steady_clock::now();
+    const int tx = int(index) % tilesX, ty = int(index) / tilesX;
+    const Rect clip = {tx * TILE_SIZE, ty * TILE_SIZE,
+                       min((tx + 1) * TILE_SIZE, wid),
+                       min((ty + 1) * TILE_SIZE, hei)};
+    copyBackground(clip);
+    TileStats tile;
+    for (unsigned i : bins[index]) {
+      const Command &command = commands[i];
+      execute(command, clip);
+      if (command.type == POINT || command.type == STAMP) {
+        ++tile.points;
+      } else if (command.type == LINE) {
+        ++tile.lines;
+      } else {
+        ++tile.fills;
+      }
+    }
+    chrono::duration<double, milli> elapsed =
+        chrono::steady_clock::now() - start;
+    tile.ms = elapsed.count();
+    stats[index] = tile;
+  }
+
+  // splits the visible pixels of an image whose bottom left pixel is (x, y)
+  // into runs, row by row
+  void buildRuns(int x, int y, int imgWid, int imgHei,
+                 const unsigned char img[]) {
+    runs.clear();
+    rowRuns.assign(hei + 1, 0);
+    foregroundBounds = Rect{max(x, 0), max(y - imgHei + 1, 0),
+                            min(x + imgWid, wid), min(y + 1, hei)};
+    for (int py = 0; py < hei; ++py) {
+      rowRuns[py] = runs.size();
+      const int row = y - py; // image rows are stored from the bottom
+      if (row < 0 || row >= imgHei) {
+        continue;
+      }
+      const unsigned char *line = &img[size_t(row) * imgWid * 4];
+      int col = max(0, -x);
+      const int end = min(imgWid, wid - x);
+      while (col < end) {
+        if (line[col * 4 + 3] == 0) {
+          ++col; // fully transparent, blending would not change anything
+          continue;
+        }
+        Run run;
+        run.x0 = x + col;
+        run.rgba = &line[col * 4];
+        run.opaque = (line[col * 4 + 3] == 255);
+        while (col < end && line[col * 4 + 3] != 0 &&
+               (line[col * 4 + 3] == 255) == run.opaque) {
+          ++col;
+        }
+        run.x1 = x + col;
+        runs.push_back(run);
+      }
+    }
+    rowRuns[hei] = runs.size();
+  }
+
+public:
+  // draws frames of frameWid x frameHei pixels, supersampled supersample
+  // times across and down and filtered down with the given filter
+  SoftwareRenderer(int frameWid, int frameHei,
+                   TaskScheduler *scheduler = nullptr, int supersample = 1,
+                   ResampleFilter filter = FILTER_BOX)
+      : outWid(frameWid), outHei(frameHei), supersample(max(supersample, 1)),
+        wid(frameWid * this->supersample), hei(frameHei * this->supersample),
+        scale(float(hei) / HEIGHT), rgba(size_t(wid) * hei * 4, 0),
+        frame(this->supersample > 1 ? size_t(outWid) * outHei * 4 : 0),
+        downsampler(scheduler, filter), scheduler(scheduler),
+        tilesX((wid + TILE_SIZE - 1) / TILE_SIZE),
+        tilesY((hei + TILE_SIZE - 1) / TILE_SIZE), bins(tilesX * tilesY),
+        stats(tilesX * tilesY) {}
+
+  int getWidth() const { return outWid; }
+  int getHeight() const { return outHei; }
+  // the canvas is supersampled, so this is supersample times the scale of
+  // the frame
+  float getScale() const override { return scale; }
+  // the frame, after endFrame()
+  const unsigned char *getPixels() const {
+    return supersample > 1 ? frame.data() : rgba.data();
+  }
+  unsigned char *getPixels() {
+    return supersample > 1 ? frame.data() : rgba.data();
+  }
+  int getTilesX() const { return tilesX; }
+  int getTilesY() const { return tilesY; }
+  // statistics of each tile of the last tiled frame, row by row
+  const vector<TileStats> &getTileStats() const { return stats; }
+
+  void setBackground(const Color &newTop, const Color &newBottom) override {
+    top = newTop;
+    bottom = newBottom;
+    backgroundValid = false;
+  }
+
+  // scales the image to the canvas once, premultiplied so that transparent
+  // pixels do not bleed into their neighbors, and splits its visible pixels
+  // into runs, row by row
+  void setForeground(float x, float y, float fgWid, float fgHei, int imgWid,
+                     int imgHei, const unsigned char img[]) override {
+    const int left = int(floorf(x * scale + 0.5f));
+    const int bottom = int(floorf(y * scale + 0.5f));
+    const int scaledWid = int(fgWid * scale + 0.5f);
+    const int scaledHei = int(fgHei * scale + 0.5f);
+    if (scaledWid == imgWid && scaledHei == imgHei) {
+      foreground.assign(img, img + size_t(imgWid) * imgHei * 4);
+    } else if (scaledWid > 0 && scaledHei > 0) {
+      vector<unsigned char> premultiplied(img,
+                                          img + size_t(imgWid) * imgHei * 4);
+      for (size_t i = 0; i < premultiplied.size(); i += 4) {
+        for (int c = 0; c < 3; ++c) {
+          premultiplied[i + c] = premultiplied[i + c] * img[i + 3] / 255;
+        }
+      }
+      foreground.resize(size_t(scaledWid) * scaledHei * 4);
+      Resampler(scheduler, FILTER_LANCZOS)
+          .resize(premultiplied.data(), imgWid, imgHei, foreground.data(),
+                  scaledWid, scaledHei);
+      for (size_t i = 0; i < foreground.size(); i += 4) {
+        const int a = foreground[i + 3];
+        for (int c = 0; c < 3; ++c) {
+          foreground[i + c] =
+              a == 0 ? 0 : min(foreground[i + c] * 255 / a, 255);
+        }
+      }
+    } else {
+      foreground.clear();
+    }
+    buildRuns(left, bottom - 1, scaledWid, scaledHei, foreground.data());
+  }
+
+  void setSmoothPoints(bool smooth) override { smoothPoints = smooth; }
+
+  void beginFrame() override {
+    commands.clear();
+    vertices.clear();
+    if (!backgroundValid) {
+      renderBackground();
+    }
+    if (scheduler == nullptr) {
+      rgba = background;
+    }
+  }
+
+  void drawPoints(const BatchVertex points[], size_t count,
+                  float size) override {
+    const CommandType type = smoothPoints ? STAMP : POINT;
+    const int width =
+        smoothPoints ? findStamps(size * scale) : pointWidth(size * scale);
+    for (size_t i = 0; i < count; ++i) {
+      vertices.push_back(toCanvas(points[i]));
+      submit(Command{type, width, vertices.size() - 1});
+    }
+  }
+
+  void drawLines(const BatchVertex ends[], size_t count) override {
+    for (size_t i = 0; i + 1 < count; i += 2) {
+      vertices.push_back(toCanvas(ends[i]));
+      vertices.push_back(toCanvas(ends[i + 1]));
+      submit(Command{LINE, 0, vertices.size() - 2});
+    }
+  }
+
+  void drawForeground() override {
+    submit(Command{FOREGROUND, 0, 0});
+  }
+
+  void drawLayer(int newLayerWid, int newLayerHei, const float r[],
+                 const float g[], const float b[], const float a[]) override {
+    layer[0] = r;
+    layer[1] = g;
+    layer[2] = b;
+    layer[3] = a;
+    if (newLayerWid != layerWid || layerColumns.empty()) {
+      layerColumns.resize(wid);
+      for (int px = 0; px < wid; ++px) {
+        layerColumns[px] = int(size_t(px) * newLayerWid / wid);
+      }
+    }
+    layerWid = newLayerWid;
+    layerHei = newLayerHei;
+    submit(Command{LAYER, 0, 0});
+  }
+
+  // rasterizes the tiles of a recorded frame, and filters the canvas down
+  // into the frame when supersampling
+  void endFrame() override {
+    if (scheduler != nullptr) {
+      bin();
+      scheduler->parallelFor(bins.size(),
+                             [this](size_t i) { rasterTile(i); });
+    }
+    if (supersample > 1) {
+      downsampler.resize(rgba.data(), wid, hei, frame.data(), outWid, outHei);
+    }
+  }
+
+  // shows the frame in the OpenGL window
+  void present() const {
+    glDisable(GL_BLEND);
+    glMatrixMode(GL_MODELVIEW);
+    glLoadIdentity();
+    glRasterPos2i(0, 0);
+    glPixelZoom(1.0f, -1.0f); // rows are stored from the top
+    glDrawPixels(outWid, outHei, GL_RGBA, GL_UNSIGNED_BYTE, getPixels());
+    glPixelZoom(1.0f, 1.0f);
+  }
+};
+
+// blurs dst[begin, end) of one row with the weights[0 .. 2 * radius], reading
+// src[begin - radius, end + radius)
+typedef void (*BlurRowKernel)(const float *src, float *dst, int begin,
+                              int end, const float *weights, int radius);
+// blurs dst[begin, end) of one row with the weights[0 .. 2 * radius], reading
+// the same columns of the 2 * radius + 1 rows around it
+typedef void (*BlurColumnKernel)(const float *const rows[], float *dst,
+                                 int begin, int end, const float *weights,
+                                 int radius);
+
+void blurRowScalar(const float *src, float *dst, int begin, int end,
+                   const float *weights, int radius) {
+  for (int x = begin; x < end; ++x) {
+    float sum = 0;
+    for (int k = -radius; k <= radius; ++k) {
+      sum += weights[k + radius] * src[x + k];
+    }
+    dst[x] = sum;
+  }
+}
+
+void blurColumnScalar(const float *const rows[], float *dst, int begin,
+                      int end, const float *weights, int radius) {
+  for (int x = begin; x < end; ++x) {
+    float sum = 0;
+    for (int k = 0; k <= 2 * radius; ++k) {
+      sum += weights[k] * rows[k][x];
+    }
+    dst[x] = sum;
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// the AVX2 blurs compute 8 neighboring outputs at once; the weights are the
+// same for all of them, so every tap is one broadcast and one fused
+// multiply-add
+__attribute__((target("avx2,fma"))) void
+blurRowAvx2(const float *src, float *dst, int begin, int end,
+            const float *weights, int radius) {
+  int x = begin;
+  for (; x + 8 <= end; x += 8) {
+    __m256 sum = _mm256_setzero_ps();
+    for (int k = -radius; k <= radius; ++k) {
+      sum = _mm256_fmadd_ps(_mm256_set1_ps(weights[k + radius]),
+                            _mm256_loadu_ps(src + x + k), sum);
+    }
+    _mm256_storeu_ps(dst + x, sum);
+  }
+  blurRowScalar(src, dst, x, end, weights, radius);
+}
+
+__attribute__((target("avx2,fma"))) void
+blurColumnAvx2(const float *const rows[], float *dst, int begin, int end,
+               const float *weights, int radius) {
+  int x = begin;
+  for (; x + 8 <= end; x += 8) {
+    __m256 sum = _mm256_setzero_ps();
+    for (int k = 0; k <= 2 * radius; ++k) {
+      sum = _mm256_fmadd_ps(_mm256_set1_ps(weights[k]),
+                            _mm256_loadu_ps(rows[k] + x), sum);
+    }
+    _mm256_storeu_ps(dst + x, sum);
+  }
+  blurColumnScalar(rows, dst, x, end, weights, radius);
+}
+#endif
+
+// the widest blur kernels the CPU supports
+struct BlurKernels {
+  BlurRowKernel row;
+  BlurColumnKernel column;
+
+  static BlurKernels pick() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+      return BlurKernels{blurRowAvx2, blurColumnAvx2};
+    }
+#endif
+    return BlurKernels{blurRowScalar, blurColumnScalar};
+  }
+
+  static const BlurKernels &get() {
+    static const BlurKernels kernels = pick();
+    return kernels;
+  }
+};
+
+// glow around bright pixels of a software-rendered frame: keeps the part of
+// every pixel above BLOOM_THRESHOLD at half resolution, blurs it with a
+// separable gaussian and adds it back onto the frame. every pass runs on the
+// scheduler; the vertical blur works on bands of rows and strips of columns
+// small enough that the rows it reads stay in the cache
+class BloomFilter {
+public:
+  // time spent in each pass of the last apply()
+  struct Timings {
+    double brightMs = 0;    // threshold and downsample
+    double rowMs = 0;       // horizontal blur
+    double columnMs = 0;    // vertical blur
+    double compositeMs = 0; // adding the glow to the frame
+  };
+
+private:
+  TaskScheduler &scheduler;  // runs the passes
+  int radius;                // blur radius in half resolution pixels
+  float intensity;           // scale of the glow added to the frame
+  vector<float> weights;     // gaussian weights of offsets -radius .. radius
+  int wid = 0, hei = 0;      // half resolution size
+  vector<float> glow[3];     // bright part, then the blurred glow, per color
+  vector<float> temp[3];     // glow blurred horizontally
+  vector<unsigned char> glowBytes; // scaled glow, 3 bytes per pixel
+  Timings timings;           // times of the last frame
+  Timings totals;            // times summed over all frames
+  int frames = 0;            // number of frames the glow was added to
+
+  // runs body(i) for i in [0, n) on the scheduler and returns the time taken
+  double timed(size_t n, const function<void(size_t)> &body) {
+    auto start = chrono::steady_clock::now();
+    scheduler.parallelFor(n, body);
+    chrono::duration<double, milli> elapsed =
+        chrono::steady_clock::now() - start;
+    return elapsed.count();
+  }
+
+  // averages 2x2 pixels of the frame and keeps the color above the threshold
+  void brightRow(const unsigned char *frame, int frameWid, int frameHei,
+                 int y) {
+    const int y0 = 2 * y, y1 = min(2 * y + 1, frameHei - 1);
+    for (int x = 0; x < wid; ++x) {
+      const int x0 = 2 * x, x1 = min(2 * x + 1, frameWid - 1);
+      float c[3];
+      for (int ch = 0; ch < 3; ++ch) {
+        c[ch] = (frame[(size_t(y0) * frameWid + x0) * 4 + ch] +
+                 frame[(size_t(y0) * frameWid + x1) * 4 + ch] +
+                 frame[(size_t(y1) * frameWid + x0) * 4 + ch] +
+                 frame[(size_t(y1) * frameWid + x1) * 4 + ch]) *
+                (1.0f / (4 * 255));
+      }
+      const float luma = 0.2126f * c[0] + 0.7152f * c[1] + 0.0722f * c[2];
+      const float keep =
+          luma > BLOOM_THRESHOLD ? (luma - BLOOM_THRESHOLD) / luma : 0;
+      for (int ch = 0; ch < 3; ++ch) {
+        glow[ch][size_t(y) * wid + x] = c[ch] * keep;
+      }
+    }
+  }
+
+  // blurs one row of one color horizontally; columns closer than radius to
+  // an edge repeat the edge pixel
+  void blurRow(int ch, int y) {
+    const float *src = &glow[ch][size_t(y) * wid];
+    float *dst = &temp[ch][size_t(y) * wid];
+    const int inner0 = min(radius, wid), inner1 = max(wid - radius, inner0);
+    for (int x = 0; x < wid; ++x) {
+      if (x == inner0) {
+        BlurKernels::get().row(src, dst, inner0, inner1, weights.data(),
+                               radius);
+        x = inner1;
+        if (x >= wid) {
+          break;
+        }
+      }
+      float sum = 0;
+      for (int k = -radius; k <= radius; ++k) {
+        sum += weights[k + radius] * src[min(max(x + k, 0), wid - 1)];
+      }
+      dst[x] = sum;
+    }
+  }
+
+  // blurs a band of rows of one color vertically, strip by strip
+  void blurColumns(int ch, int band) {
+    const int y0 = band * BLOOM_BAND, y1 = min(y0 + BLOOM_BAND, hei);
+    vector<const float *> rows(2 * radius + 1);
+    for (int x = 0; x < wid; x += BLOOM_STRIP) {
+      const int end = min(x + BLOOM_STRIP, wid);
+      for (int y = y0; y < y1; ++y) {
+        for (int k = -radius; k <= radius; ++k) {
+          rows[k + radius] =
+              &temp[ch][size_t(min(max(y + k, 0), hei - 1)) * wid];
+        }
+        BlurKernels::get().column(rows.data(), &glow[ch][size_t(y) * wid], x,
+                                  end, weights.data(), radius);
+      }
+    }
+  }
+
+  // scales one row of the glow to bytes
+  void glowRowToBytes(int y) {
+    unsigned char *dst = &glowBytes[size_t(y) * wid * 3];
+    for (size_t i = size_t(y) * wid; i < size_t(y + 1) * wid; ++i) {
+      *dst++ = toByte(glow[0][i] * intensity);
+      *dst++ = toByte(glow[1][i] * intensity);
+      *dst++ = toByte(glow[2][i] * intensity);
+    }
+  }
+
+  // adds the glow to one row of the frame, which uses every glow pixel for
+  // 2x2 frame pixels
+  void compositeRow(unsigned char *frame, int frameWid, int y) {
+    const unsigned char *src = &glowBytes[size_t(y / 2) * wid * 3];
+    unsigned char *row = &frame[size_t(y) * frameWid * 4];
+    for (int x = 0; x < frameWid; ++x) {
+      const unsigned char *add = src + (x / 2) * 3;
+      if ((add[0] | add[1] | add[2]) == 0) {
+        continue; // most of the sky does not glow
+      }
+      unsigned char *dst = row + x * 4;
+      const unsigned r = dst[0] + add[0], g = dst[1] + add[1],
+                     b = dst[2] + add[2];
+      dst[0] = (unsigned char)min(r, 255u);
+      dst[1] = (unsigned char)min(g, 255u);
+      dst[2] = (unsigned char)min(b, 255u);
+    }
+  }
+
+public:
+  BloomFilter(TaskScheduler &scheduler, int radius, float intensity)
+      : scheduler(scheduler), radius(max(radius, 1)), intensity(intensity) {
+    const double sigma = this->radius / 2.0;
+    double total = 0;
+    for (int k = -this->radius; k <= this->radius; ++k) {
+      weights.push_back(float(exp(-k * k / (2 * sigma * sigma))));
+      total += weights.back();
+    }
+    for (auto &w : weights) {
+      w = float(w / total);
+    }
+  }
+
+  // adds the glow to the RGBA frame (rows from top to bottom)
+  void apply(unsigned char *frame, int frameWid, int frameHei) {
+    if ((frameWid + 1) / 2 != wid || (frameHei + 1) / 2 != hei) {
+      wid = (frameWid + 1) / 2;
+      hei = (frameHei + 1) / 2;
+      for (int ch = 0; ch < 3; ++ch) {
+        glow[ch].assign(size_t(wid) * hei, 0);
+        temp[ch].assign(size_t(wid) * hei, 0);
+      }
+      glowBytes.assign(size_t(wid) * hei * 3, 0);
+    }
+    timings.brightMs = timed(hei, [&](size_t y) {
+      brightRow(frame, frameWid, frameHei, int(y));
+    });
+    timings.rowMs = timed(3 * size_t(hei), [this](size_t i) {
+      blurRow(int(i) / hei, int(i) % hei);
+    });
+    const int bands = (hei + BLOOM_BAND - 1) / BLOOM_BAND;
+    timings.columnMs = timed(3 * size_t(bands), [this, bands](size_t i) {
+      blurColumns(int(i) / bands, int(i) % bands);
+    });
+    timings.compositeMs =
+        timed(hei, [this](size_t y) { glowRowToBytes(int(y)); }) +
+        timed(frameHei, [&](size_t y) {
+          compositeRow(frame, frameWid, int(y));
+        });
+    totals.brightMs += timings.brightMs;
+    totals.rowMs += timings.rowMs;
+    totals.columnMs += timings.columnMs;
+    totals.compositeMs += timings.compositeMs;
+    ++frames;
+  }
+
+  const Timings &getTimings() const { return timings; }
+  const Timings &getTotals() const { return totals; }
+  int getFrames() const { return frames; }
+};
+
+// streams rendered frames to a file or a pipe as raw RGBA or as a Y4M video.
+// converting and writing run on a thread of their own with two frame slots,
+// so the next frame is simulated and drawn while the last one is written
+class FrameWriter {
+private:
+  // one frame waiting to be written
+  struct Slot {
+    vector<unsigned char> rgba; // copy of the framebuffer
+    bool full = false;          // set until the frame has been written
+  };
+
+  FILE *file = nullptr;      // output, stdout for "-"
+  bool y4m;                  // Y4M video instead of raw RGBA
+  int wid, hei;              // frame size
+  Slot slots[2];             // frames being filled and written
+  int next = 0;              // slot the next frame goes into
+  mutex lock;                // guards the slots and closing
+  condition_variable changed; // signals a filled or a written slot
+  bool closing = false;      // set when no more frames will come
+  bool failed = false;       // set when a write fails
+  vector<unsigned char> yuv; // Y4M frame being written
+  thread writer;             // writes the frames
+
+  // converts RGBA to 4:2:0 YCbCr with full range BT.601 coefficients
+  void toYuv(const unsigned char *rgba) {
+    unsigned char *y = yuv.data();
+    unsigned char *u = y + size_t(wid) * hei;
+    unsigned char *v = u + size_t((wid + 1) / 2) * ((hei + 1) / 2);
+    for (int py = 0; py < hei; ++py) {
+      const unsigned char *src = &rgba[size_t(py) * wid * 4];
+      for (int px = 0; px < wid; ++px, src += 4) {
+        *y++ = (unsigned char)((77 * src[0] + 150 * src[1] + 29 * src[2] +
+                                128) >> 8);
+      }
+    }
+    for (int py = 0; py < hei; py += 2) {
+      for (int px = 0; px < wid; px += 2) {
+        // average the 2x2 block, repeating the last row or column
+        int r = 0, g = 0, b = 0;
+        for (int k = 0; k < 4; ++k) {
+          const int sx = min(px + (k & 1), wid - 1);
+          const int sy = min(py + (k >> 1), hei - 1);
+          const unsigned char *src = &rgba[(size_t(sy) * wid + sx) * 4];
+          r += src[0];
+          g += src[1];
+          b += src[2];
+        }
+        // the coefficients are scaled by 256 and the sums by 4
+        *u++ = (unsigned char)min(
+            (-43 * r - 85 * g + 128 * b + 1024 * 128 + 512) >> 10, 255);
+        *v++ = (unsigned char)min(
+            (128 * r - 107 * g - 21 * b + 1024 * 128 + 512) >> 10, 255);
+      }
+    }
+  }
+
+  bool write(const unsigned char *rgba) {
+    if (!y4m) {
+      return fwrite(rgba, 4, size_t(wid) * hei, file) == size_t(wid) * hei;
+    }
+    toYuv(rgba);
+    return fputs("FRAME\n", file) >= 0 &&
+           fwrite(yuv.data(), 1, yuv.size(), file) == yuv.size();
+  }
+
+  void writerMain() {
+    int current = 0;
+    while (true) {
+      unique_lock<mutex> guard(lock);
+      changed.wait(guard, [&] { return slots[current].full || closing; });
+      if (!slots[current].full) {
+        return; // closing and every frame has been written
+      }
+      guard.unlock();
+      bool ok = write(slots[current].rgba.data());
+      guard.lock();
+      failed = failed || !ok;
+      slots[current].full = false;
+      changed.notify_all();
+      current = 1 - current;
+    }
+  }
+
+public:
+  FrameWriter(bool y4m, int wid, int hei) : y4m(y4m), wid(wid), hei(hei) {}
+
+  ~FrameWriter() { close(); }
+
+  // opens the output ("-" for stdout) and writes the stream header; returns
+  // false when the file cannot be opened
+  bool open(const char path[], int fps) {
+    file = strcmp(path, "-") == 0 ? stdout : fopen(path, "wb");
+    if (file == nullptr) {
+      return false;
+    }
+    if (y4m) {
+      fprintf(file,
+              "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg XCOLORRANGE=FULL\n",
+              wid, hei, fps);
+      yuv.resize(size_t(wid) * hei +
+                 2 * size_t((wid + 1) / 2) * ((hei + 1) / 2));
+    }
+    for (auto &slot : slots) {
+      slot.rgba.resize(size_t(wid) * hei * 4);
+    }
+    writer = thread(&FrameWriter::writerMain, this);
+    return true;
+  }
+
+  // queues a copy of the frame, waiting while both slots are in use
+  void submit(const unsigned char *rgba) {
+    Slot &slot = slots[next];
+    {
+      unique_lock<mutex> guard(lock);
+      changed.wait(guard, [&] { return !slot.full; });
+    }
+    copy(rgba, rgba + slot.rgba.size(), slot.rgba.begin());
+    {
+      lock_guard<mutex> guard(lock);
+      slot.full = true;
+    }
+    changed.notify_all();
+    next = 1 - next;
+  }
+
+  // writes the queued frames and closes the output; returns false if any
+  // write failed
+  bool close() {
+    if (writer.joinable()) {
+      {
+        lock_guard<mutex> guard(lock);
+        closing = true;
+      }
+      changed.notify_all();
+      writer.join();
+    }
+    if (file != nullptr) {
+      failed = fflush(file) != 0 || failed;
+      if (file != stdout) {
+        failed = fclose(file) != 0 || failed;
+      }
+      file = nullptr;
+    }
+    return !failed;
+  }
+};
+
+// options given on the command line
+struct ShowOptions {
+  int numThreads;    // number of threads that update the fireworks
+  uint64_t seed;     // seed of every random number in the show
+  int headlessSteps; // steps to simulate without a window, 0 for a window
+  double targetFrameMs; // frame time the governor holds, 0 for full quality
+  int minQuality;       // lowest quality level the governor may pick
+  bool software;        // draw with the CPU rasterizer instead of OpenGL
+  bool accumulateTrails; // draw trails into a fading buffer, not as samples
+  int bloomRadius;       // glow radius of software frames, 0 for no glow
+  float bloomIntensity;  // brightness of the glow
+  int renderFrames;      // frames to render to a file, 0 to show the show
+  const char *output;    // file rendered frames go to, "-" for stdout
+  bool y4m;              // render a Y4M video instead of raw RGBA
+  int fps;               // frames per second of rendered video
+  bool simThread;        // update the show on its own thread
+  bool smoothPoints;     // draw points as anti-aliased discs
+  int pointBenchmark;    // smooth points to time, 0 to show the show
+  int pngBenchmark;      // decodes of the skyline to time, 0 to show the show
+  int wid, hei;          // size of the window or frames in pixels
+  int supersample;       // software canvas pixels per frame pixel, across
+  ResampleFilter downsample; // filter of supersampled frames
+
+  ShowOptions() {
+    numThreads = max(1, int(thread::hardware_concurrency()));
+    seed = time(0);
+    headlessSteps = 0;
+    targetFrameMs = 0;
+    minQuality = 0;
+    software = false;
+    accumulateTrails = false;
+    bloomRadius = 0;
+    bloomIntensity = 1.5f;
+    renderFrames = 0;
+    output = "-";
+    y4m = true;
+    fps = 60;
+    simThread = false;
+    smoothPoints = false;
+    pointBenchmark = 0;
+    pngBenchmark = 0;
+    wid = WIDTH;
+    hei = HEIGHT;
+    supersample = 1;
+    downsample = FILTER_BOX;
+  }
+
+  // reads the options; returns false on an unknown or malformed option
+  bool parse(int argc, char *argv[]) {
+    for (int i = 1; i < argc; ++i) {
+      if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+        numThreads = max(1, atoi(argv[++i]));
+      } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+        seed = strtoull(argv[++i], nullptr, 10);
+      } else if (strcmp(argv[i], "--headless") == 0 && i + 1 < argc) {
+        headlessSteps = max(1, atoi(argv[++i]));
+      } else if (strcmp(argv[i], "--target-ms") == 0 && i + 1 < argc) {
+        targetFrameMs = max(0.0, atof(argv[++i]));
+      } else if (strcmp(argv[i], "--min-quality") == 0 && i + 1 < argc) {
+        minQuality = atoi(argv[++i]);
+      } else if (strcmp(argv[i], "--trails") == 0 && i + 1 < argc) {
+        ++i;
+        if (strcmp(argv[i], "accumulate") == 0) {
+          accumulateTrails = true;
+        } else if (strcmp(argv[i], "samples") == 0) {
+          accumulateTrails = false;
+        } else {
+          return false;
+        }
+      } else if (strcmp(argv[i], "--bloom") == 0 && i + 1 < argc) {
+        bloomRadius = max(0, atoi(argv[++i]));
+      } else if (strcmp(argv[i], "--bloom-intensity") == 0 && i + 1 < argc) {
+        bloomIntensity = max(0.0, atof(argv[++i]));
+      } else if (strcmp(argv[i], "--render") == 0 && i + 1 < argc) {
+        renderFrames = max(1, atoi(argv[++i]));
+      } else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+        output = argv[++i];
+      } else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+        ++i;
+        if (strcmp(argv[i], "y4m") == 0) {
+          y4m = true;
+        } else if (strcmp(argv[i], "rgba") == 0) {
+          y4m = false;
+        } else {
+          return false;
+        }
+      } else if (strcmp(argv[i], "--fps") == 0 && i + 1 < argc) {
+        fps = max(1, atoi(argv[++i]));
+      } else if (strcmp(argv[i], "--points") == 0 && i + 1 < argc) {
+        ++i;
+        if (strcmp(argv[i], "smooth") == 0) {
+          smoothPoints = true;
+        } else if (strcmp(argv[i], "square") == 0) {
+          smoothPoints = false;
+        } else {
+          return false;
+        }
+      } else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+        if (sscanf(argv[++i], "%dx%d", &wid, &hei) != 2 || wid <= 0 ||
+            hei <= 0) {
+          return false;
+        }
+      } else if (strcmp(argv[i], "--supersample") == 0 && i + 1 < argc) {
+        supersample = min(max(1, atoi(argv[++i])), 4);
+      } else if (strcmp(argv[i], "--downsample") == 0 && i + 1 < argc) {
+        ++i;
+        if (strcmp(argv[i], "box") == 0) {
+          downsample = FILTER_BOX;
+        } else if (strcmp(argv[i], "lanczos") == 0) {
+          downsample = FILTER_LANCZOS;
+        } else {
+          return false;
+        }
+      } else if (strcmp(argv[i], "--bench-points") == 0 && i + 1 < argc) {
+        pointBenchmark = max(1, atoi(argv[++i]));
+      } else if (strcmp(argv[i], "--bench-png") == 0 && i + 1 < argc) {
+        pngBenchmark = max(1, atoi(argv[++i]));
+      } else if (strcmp(argv[i], "--sim-thread") == 0) {
+        simThread = true;
+      } else if (strcmp(argv[i], "--renderer") == 0 && i + 1 < argc) {
+        ++i;
+        if (strcmp(argv[i], "software") == 0) {
+          software = true;
+        } else if (strcmp(argv[i], "gl") == 0) {
+          software = false;
+        } else {
+          return false;
+        }
+      } else {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  static void printUsage(const char program[]) {
+    printf("Usage: %s [--threads N] [--seed N] [--headless N] [--target-ms T]"
+           " [--min-quality L] [--renderer gl|software]"
+           " [--trails samples|accumulate] [--bloom R]"
+           " [--bloom-intensity I] [--render N [--output FILE]"
+           " [--format y4m|rgba] [--fps F]] [--sim-thread]"
+           " [--points square|smooth] [--bench-points N] [--bench-png N]"
+           " [--size WxH]"
+           " [--supersample S [--downsample box|lanczos]]\n",
+           program);
+    printf("  --threads N      update the fireworks on N threads\n");
+    printf("  --seed N         replay the show with seed N\n");
+    printf("  --headless N     simulate N steps without a window\n");
+    printf("  --target-ms T    lower the particle budget to hold T ms per"
+           " frame\n");
+    printf("  --min-quality L  never go below quality level L (0 to %d)\n",
+           NUM_QUALITY_LEVELS - 1);
+    printf("  --renderer R     draw with OpenGL (gl) or on the CPU (software);"
+           " with\n"
+           "                   --headless, software also draws every step\n");
+    printf("  --trails T       keep trails as faded samples per particle"
+           " (samples) or\n"
+           "                   in one buffer that fades every update"
+           " (accumulate)\n");
+    printf("  --bloom R        add a glow of radius R pixels to software"
+           " frames\n");
+    printf("  --bloom-intensity I  brightness of the glow (default 1.5)\n");
+    printf("  --render N       render N frames on the CPU without a window"
+           " and write\n"
+           "                   them to FILE (default - for stdout) as a Y4M"
+           " video or raw\n"
+           "                   RGBA at F frames per second (default 60)\n");
+    printf("  --sim-thread     update the show on its own thread, so slow"
+           " frames do not\n"
+           "                   hold it up\n");
+    printf("  --points P       draw points as squares (square) or as"
+           " anti-aliased discs\n"
+           "                   (smooth)\n");
+    printf("  --bench-points N time N smooth points stamped from tables"
+           " against\n"
+           "                   computing the coverage of every pixel\n");
+    printf("  --bench-png N    check the SIMD unfilters of the PNG decoder,"
+           " then time N\n"
+           "                   decodes of the skyline image, inflating alone,"
+           " into pixels,\n"
+           "                   and pushed in pieces\n");
+    printf("  --size WxH       window or frame size in pixels (default"
+           " %dx%d); the\n"
+           "                   world is %d units high and as wide as the"
+           " aspect ratio\n",
+           WIDTH, HEIGHT, HEIGHT);
+    printf("  --supersample S  draw software frames at S times the size"
+           " across and down\n"
+           "                   (1 to 4) and filter them down with a box"
+           " (default) or\n"
+           "                   lanczos filter\n");
+  }
+};
+
+class Star {
+private:
+  double x, y;        // position of star
+  float a;            // brightness of star
+  float twinkleSpeed; // speed of a oscillation
+
+public:
+  Star(double x, double y, float a, Pcg32 &rng) : x(x), y(y), a(a) {
+    // random speed between [-0.01, 0.01]
+    twinkleSpeed = randRange(rng, -0.01, 0.01);
+  }
+
+  // update a for twinkle effect
+  void update() {
+    a += twinkleSpeed;
+    if (a > 1 || a < 0) {
+      twinkleSpeed *= -1;
+    }
+  }
+
+  // draws the star
+  void draw(RenderBatch &batch) const {
+    batch.addPoint(x, y, STAR_SIZE, Color(1.0, 1.0, 1.0, a)); // white color
+  }
+};
+
+class ShootingStar {
+private:
+  double x, y;      // position of the shooting star
+  double vx, vy;    // velocity
+  float brightness; // brightness of the star
+
+public:
+  ShootingStar(double startX, double startY, double endX, double endY) {
+    x = startX;
+    y = startY;
+    double dx = endX - startX;
+    double dy = endY - startY;
+    double length = sqrt(dx * dx + dy * dy); // estimate of speed needed
+    vx = dx / length;
+    vy = dy / length;
+    brightness = 1.0f;
   }
 
   // update the shooting star's position and brightness
@@ -413,19 +3181,21 @@ public:
   // Check if the shooting star is still visible
   bool isVisible() const { return brightness > 0; }
 
-  // Draw the shooting star
-  void draw() const {
-    glColor4f(1.0, 1.0, 1.0, brightness);
-    glBegin(GL_LINES);
-    glVertex2d(x, y);
-    glVertex2d(x - vx * 10, y - vy * 10); // Render as a short line segment
-    glEnd();
+  // Draw the shooting star, alpha of the way through its last update
+  void draw(RenderBatch &batch, double alpha) const {
+    double headX = x - vx * 5 * (1 - alpha);
+    double headY = y - vy * 5 * (1 - alpha);
+    // Render as a short line segment
+    batch.addLine(headX, headY, headX - vx * 10, headY - vy * 10,
+                  Color(1.0, 1.0, 1.0, brightness));
   }
 };
 
 class Skyline {
 private:
-  YsRawPngDecoder png; // decoder png object
+  YsRawPngDecoder png;         // decoder png object
+  vector<unsigned char> layer; // the skyline repeated across the world
+  int layerWid = 0;            // width of layer in pixels
 
 public:
   Skyline() { load("skyline.png"); }
@@ -435,22 +3205,56 @@ public:
     png.Flip();
   }
 
-  void draw() {
-    glRasterPos2d(0.0, HEIGHT - 1);
-    glDrawPixels(png.wid, png.hei, GL_RGBA, GL_UNSIGNED_BYTE, png.rgba);
+  // makes the skyline the foreground of the renderer, across the bottom of
+  // a world worldWid units wide. the skyline keeps its own aspect ratio: the
+  // original is centered, and a wider world repeats it on both sides while a
+  // narrower one crops it. a renderer may keep a pointer to the pixels, so
+  // they are only rebuilt when the width changes
+  void attach(Renderer &renderer, float worldWid) {
+    if (png.wid <= 0 || png.hei <= 0) {
+      return;
+    }
+    const int wid = max(1, int(ceilf(worldWid)));
+    if (wid != layerWid) {
+      layerWid = wid;
+      layer.resize(size_t(wid) * png.hei * 4);
+      const int offset = (png.wid - wid) / 2;
+      for (int y = 0; y < png.hei; ++y) {
+        for (int x = 0; x < wid; ++x) {
+          const int src = ((x + offset) % png.wid + png.wid) % png.wid;
+          const unsigned char *pixel =
+              &png.rgba[(size_t(y) * png.wid + src) * 4];
+          copy(pixel, pixel + 4, &layer[(size_t(y) * wid + x) * 4]);
+        }
+      }
+    }
+    renderer.setForeground(0, HEIGHT, float(wid), png.hei, wid, png.hei,
+                           layer.data());
   }
 };
 
 class Demo {
 private:
-  vector<Firework *> fireworks;       // vector of all fireworks
+  YsSoundPlayer player;               // primary sound player for fireworks
+  SoundCache sounds;                  // decoded sound effects
+  FireworkPool fireworks;             // pool of all fireworks
   vector<Star> stars;                 // vector of all stars
   vector<ShootingStar> shootingStars; // vector of all shooting stars
   vector<Color> fireworkColors;       // vector of all firework colors
   Skyline skyline;                    // skyline of the city
-  YsSoundPlayer player;               // primary sound player for fireworks
-  YsSoundPlayer::SoundData hissSound; // sound data for hissing sound
-  int timeElapsed = 0;                // time elapsed to keep adding fireworks
+  shared_ptr<SharedSound> hissSound;  // sound data for hissing sound
+  int timeSinceLaunch = 0;            // time elapsed to keep adding fireworks
+  TaskScheduler scheduler;            // threads that update the fireworks
+  Pcg32 rng;                          // random numbers of the show
+  QualitySettings quality;            // current particle budget
+  RenderSnapshot frame;               // frame drawn by draw()
+  int drawCalls = 0;                  // renderer calls made by draw()
+  unique_ptr<TrailAccumulator> accumulation; // trails, when not sampled
+  shared_ptr<SharedSound> burstSound; // keeps the burst sound loaded
+  SpscQueue<SharedSound *> *soundQueue = nullptr; // sounds to play, if set
+  bool smoothPoints;                  // draw points as discs
+  double worldWid;                    // width of the world in world units
+  bool audio;                         // whether sounds are loaded and played
 
   void addFireworkColors() {
     fireworkColors.push_back(Color(1.0f, 0.5f, 0.5f)); // reddish
@@ -461,66 +3265,122 @@ private:
   }
 
   void addRandomFireworks(int count) {
-    fireworks.reserve(fireworks.size() + count);
     for (int i = 0; i < count; ++i) {
-      double x = randRange(WIDTH / 8, WIDTH * 7 / 8);
-      double vx = (x < WIDTH / 2) ? randRange(0, 2) : randRange(-2, 0);
-      double vy = randRange(-2.5, -3.5);
-      Color color = fireworkColors[randRange(0, fireworkColors.size())];
-      fireworks.push_back(new Firework(x, HEIGHT, vx, vy, color, player));
+      double x = randRange(rng, worldWid / 8, worldWid * 7 / 8);
+      double vx =
+          (x < worldWid / 2) ? randRange(rng, 0, 2) : randRange(rng, -2, 0);
+      double vy = randRange(rng, -2.5, -3.5);
+      Color color = fireworkColors[randRange(rng, 0, fireworkColors.size())];
+      fireworks.launch(x, HEIGHT, vx, vy, color, rng.split());
     }
   }
 
 public:
-  Demo() {
+  // without audio, e.g. when there is no window, no sound is loaded or played
+  // and the player is never started
+  Demo(const ShowOptions &options, bool audio)
+      : sounds(player, audio), fireworks(sounds),
+        scheduler(options.numThreads), rng(options.seed),
+        quality(QUALITY_LEVELS[NUM_QUALITY_LEVELS - 1]),
+        smoothPoints(options.smoothPoints),
+        worldWid(double(options.wid) * HEIGHT / options.hei), audio(audio) {
+    if (audio) {
+      player.Start(); // start first so sounds are prepared as they load
+    }
+    if (options.accumulateTrails) {
+      accumulation.reset(
+          new TrailAccumulator(worldWid, double(options.hei) / HEIGHT));
+      quality.maxTrail = 0;
+    }
     addFireworkColors(); // initialize firework colors
     addRandomFireworks(6);
     stars.reserve(NUM_STARS); // reserve memory to avoid resizing overhead
     for (int i = 0; i < NUM_STARS; ++i) {
       stars.push_back(
-          Star(randRange(0, WIDTH), randRange(0, HEIGHT), randRange(0, 1)));
+          Star(randRange(rng, 0, worldWid), randRange(rng, 0, HEIGHT),
+               randRange(rng, 0, 1), rng));
+    }
+    // sound. the burst sound is loaded up front, so fireworks only ever find
+    // it in the cache and never touch the player
+    if (audio) {
+      burstSound = sounds.load("burst.wav", NUM_BURST_VOICES);
+      burstSound->setVolume(player, VOLUME);
+      hissSound = sounds.load("hiss.wav");
+      hissSound->setVolume(player, VOLUME);
+      hissSound->play(player);
     }
-    // sound
-    hissSound.LoadWav("hiss.wav");
-    player.SetVolume(hissSound, VOLUME);
-    player.Start();
-    player.PlayOneShot(hissSound);
   }
-  ~Demo() {
-    for (auto firework : fireworks) {
-      delete firework;
+  const SoundCache &getSounds() const { return sounds; }
+
+  // changes the particle budget, e.g. to the QualityGovernor's choice
+  void setQuality(const QualitySettings &newQuality) {
+    quality = newQuality;
+    if (accumulation) {
+      quality.maxTrail = 0; // the accumulation buffer draws the trails
     }
-    fireworks.clear();
   }
 
-  void update() {
+  // makes update() queue its sounds instead of playing them, so it can run
+  // on a thread that does not own the sound player. the queued sounds are
+  // played by playQueuedSounds()
+  void setSoundQueue(SpscQueue<SharedSound *> *queue) { soundQueue = queue; }
+
+  // plays the sounds queued by update() on the thread that owns the player
+  void playQueuedSounds() {
+    SharedSound *sound;
+    while (soundQueue->pop(sound)) {
+      sound->play(player);
+    }
     player.KeepPlaying();
-    timeElapsed += 1;
+  }
+
+  void update() {
+    if (audio && soundQueue == nullptr) {
+      player.KeepPlaying();
+    }
+    timeSinceLaunch += 1;
     for (auto &star : stars) {
       star.update();
     }
-    for (auto &firework : fireworks) {
-      (*firework).update();
+    scheduler.parallelFor(fireworks.size(),
+                          [this](size_t i) { fireworks[i].update(quality); });
+    for (size_t i = 0; i < fireworks.size(); ++i) {
+      SharedSound *sound = fireworks[i].takeBurstSound();
+      if (sound == nullptr) {
+        continue;
+      }
+      if (soundQueue == nullptr) {
+        sound->play(player);
+      } else {
+        soundQueue->push(sound); // a full queue drops the sound
+      }
+    }
+    if (accumulation) {
+      accumulation->decay();
+      for (size_t i = 0; i < fireworks.size(); ++i) {
+        fireworks[i].depositTrails(*accumulation);
+      }
     }
-    // add 4 new fireworks every couple seconds
-    if (timeElapsed % 200 == 0) {
-      addRandomFireworks(4);
+    // add new fireworks every couple seconds (4 every 200 updates at full
+    // quality)
+    if (timeSinceLaunch >= quality.launchInterval) {
+      addRandomFireworks(quality.launchCount);
+      timeSinceLaunch = 0;
     }
-    // remove dead fireworks for performance
-    for (auto firework = fireworks.begin(); firework != fireworks.end();) {
-      if ((*firework)->hasReachedBottom()) {
-        delete *firework;
-        firework = fireworks.erase(firework);
+    // return dead fireworks to the pool for reuse
+    for (size_t i = 0; i < fireworks.size();) {
+      if (fireworks[i].hasReachedBottom()) {
+        fireworks.release(fireworks.handleAt(i));
       } else {
-        ++firework;
+        ++i;
       }
     }
     // 0.04% chance every update to spawn a shooting star
-    if (rand() % 2500 == 0) {
-      double startX = WIDTH * rand() % 1;       // start at right or left end
-      double startY = randRange(0, HEIGHT / 4); // start at top quarter
-      double endX = WIDTH - startX;             // end at other end
-      double endY = randRange(startY, HEIGHT);
+    if (rng.next() % 2500 == 0) {
+      double startX = worldWid * (rng.next() % 2);   // start at right or left end
+      double startY = randRange(rng, 0, HEIGHT / 4); // start at top quarter
+      double endX = worldWid - startX;               // end at other end
+      double endY = randRange(rng, startY, HEIGHT);
       shootingStars.push_back(ShootingStar(startX, startY, endX, endY));
     }
     for (auto star = shootingStars.begin(); star != shootingStars.end();) {
@@ -533,50 +3393,655 @@ public:
     }
   }
 
-  void drawGradientBackground() {
-    glBegin(GL_QUADS);
-    // top color
-    Color(23.0f / 255.0f, 53.0f / 255.0f, 97.0f / 255.0f).use();
-    glVertex2i(0, 0);
-    glVertex2i(WIDTH, 0);
-    // bottom color
-    Color(7.0f / 255.0f, 17.0f / 255.0f, 50.0f / 255.0f).use();
-    glVertex2i(WIDTH, HEIGHT);
-    glVertex2i(0, HEIGHT);
-    glEnd();
+  // sets the static layers of the renderer: the gradient sky behind
+  // everything and the skyline in front of the stars, and how points look.
+  // accumulated trails are restarted at the resolution of the renderer's
+  // canvas, so they are not magnified at large or supersampled sizes; attach
+  // the renderer that draws the show last, and not while update() runs
+  void attach(Renderer &renderer) {
+    renderer.setSmoothPoints(smoothPoints);
+    renderer.setBackground(
+        Color(23.0f / 255.0f, 53.0f / 255.0f, 97.0f / 255.0f), // top color
+        Color(7.0f / 255.0f, 17.0f / 255.0f, 50.0f / 255.0f)); // bottom color
+    skyline.attach(renderer, worldWid);
+    if (accumulation && accumulation->getScale() != renderer.getScale()) {
+      accumulation.reset(new TrailAccumulator(worldWid, renderer.getScale()));
+    }
   }
 
-  void draw() {
-    glEnable(GL_BLEND);
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-    drawGradientBackground();
-    for (auto &star : stars) {
-      star.draw();
+  // records the show alpha of the way between the last two updates into a
+  // snapshot. with copyLayer the accumulated trails are copied into it, so it
+  // stays valid while the show keeps updating; otherwise it points at them
+  void capture(RenderSnapshot &snapshot, double alpha, bool copyLayer) const {
+    snapshot.sky.clear();
+    snapshot.fireworks.clear();
+    for (const auto &star : stars) {
+      star.draw(snapshot.sky);
     }
     for (const auto &star : shootingStars) {
-      star.draw();
+      star.draw(snapshot.sky, alpha);
+    }
+    for (size_t i = 0; i < fireworks.size(); ++i) {
+      fireworks[i].draw(snapshot.fireworks, alpha);
+    }
+    const float *planes[4] = {nullptr, nullptr, nullptr, nullptr};
+    if (accumulation) {
+      snapshot.layerWid = accumulation->getWidth();
+      snapshot.layerHei = accumulation->getHeight();
+      planes[0] = accumulation->getR();
+      planes[1] = accumulation->getG();
+      planes[2] = accumulation->getB();
+      planes[3] = accumulation->getA();
+    }
+    for (int c = 0; c < 4; ++c) {
+      if (copyLayer && planes[c] != nullptr) {
+        const size_t n = size_t(accumulation->getWidth()) *
+                         accumulation->getHeight();
+        snapshot.layer[c].assign(planes[c], planes[c] + n);
+        snapshot.layerPlanes[c] = snapshot.layer[c].data();
+      } else {
+        snapshot.layerPlanes[c] = planes[c];
+      }
+    }
+  }
+
+  // draws the show alpha of the way between the last two updates
+  void draw(Renderer &renderer, double alpha) {
+    capture(frame, alpha, false);
+    drawCalls += frame.draw(renderer);
+  }
+
+  int getDrawCalls() const { return drawCalls; }
+  TaskScheduler &getScheduler() { return scheduler; }
+};
+
+// adaptive particle budget. measures how long each frame spends updating and
+// drawing, and steps the quality level down when the average goes over the
+// target frame time and back up when there is plenty of headroom, staying
+// within [minLevel, NUM_QUALITY_LEVELS - 1]
+class QualityGovernor {
+private:
+  double targetMs;           // frame time to hold
+  int minLevel;              // lowest level the governor may pick
+  int level;                 // current quality level
+  double averageMs;          // moving average of the frame time
+  int framesSinceChange = 0; // frames measured at the current level
+
+public:
+  QualityGovernor(double targetMs, int minLevel)
+      : targetMs(targetMs),
+        minLevel(min(max(minLevel, 0), NUM_QUALITY_LEVELS - 1)),
+        level(NUM_QUALITY_LEVELS - 1), averageMs(targetMs * 0.5) {}
+
+  // records the update + draw time of a frame; returns true when the level
+  // changed
+  bool record(double frameMs) {
+    averageMs = averageMs * 0.9 + frameMs * 0.1;
+    // give the average time to settle at a new level before changing again
+    if (++framesSinceChange < 30) {
+      return false;
+    }
+    int newLevel = level;
+    if (averageMs > targetMs && level > minLevel) {
+      newLevel = level - 1;
+    } else if (averageMs < targetMs * 0.6 && level < NUM_QUALITY_LEVELS - 1) {
+      newLevel = level + 1;
     }
-    skyline.draw();
-    for (auto &firework : fireworks) {
-      (*firework).draw();
+    if (newLevel == level) {
+      return false;
+    }
+    level = newLevel;
+    framesSinceChange = 0;
+    return true;
+  }
+
+  int getLevel() const { return level; }
+  double getAverageMs() const { return averageMs; }
+  const QualitySettings &getSettings() const { return QUALITY_LEVELS[level]; }
+};
+
+// fixed-timestep clock. turns the wall-clock time that passed since the last
+// frame into a whole number of SIM_STEP_MS simulation steps and carries the
+// remainder over, so the show plays at the same speed however long a frame
+// takes to render
+class SimulationClock {
+private:
+  long long last;         // time of the last advance in milliseconds
+  long long accumulated;  // time not yet simulated in milliseconds
+
+public:
+  SimulationClock() : last(FsSubSecondTimer()), accumulated(0) {}
+
+  // returns the number of steps to simulate for this frame. after a long
+  // stall at most MAX_STEPS_PER_FRAME are run and the rest is dropped, so a
+  // slow frame does not snowball into slower ones
+  int advance() {
+    long long now = FsSubSecondTimer();
+    accumulated += now - last;
+    last = now;
+    int steps = int(accumulated / SIM_STEP_MS);
+    if (steps > MAX_STEPS_PER_FRAME) {
+      steps = MAX_STEPS_PER_FRAME;
+      accumulated %= SIM_STEP_MS;
+    } else {
+      accumulated -= steps * SIM_STEP_MS;
     }
+    return steps;
   }
+
+  // fraction of the next step that has already passed, for interpolation
+  double getAlpha() const { return double(accumulated) / SIM_STEP_MS; }
 };
 
-int main(void) {
-  srand(time(0));
-  FsOpenWindow(0, 0, WIDTH, HEIGHT, 1);
-  Demo app;
+// prints the average time of each glow pass
+void printBloomTimings(const BloomFilter &bloom) {
+  if (bloom.getFrames() == 0) {
+    return;
+  }
+  const BloomFilter::Timings &totals = bloom.getTotals();
+  const double n = bloom.getFrames();
+  printf("bloom: %.3f ms bright pass, %.3f ms row blur, %.3f ms column blur,"
+         " %.3f ms composite per frame\n",
+         totals.brightMs / n, totals.rowMs / n, totals.columnMs / n,
+         totals.compositeMs / n);
+}
+
+// shows the quality level the governor picked in the window title
+void showQualityLevel(int level) {
+  char title[64];
+  snprintf(title, sizeof(title), "Fireworks - quality %d/%d", level,
+           NUM_QUALITY_LEVELS - 1);
+  FsSetWindowTitle(title);
+}
+
+// runs the show in a window in real time
+void runWindowed(const ShowOptions &options) {
+  FsOpenWindow(0, 0, options.wid, options.hei, 1);
+  Demo app(options, true);
+  SimulationClock clock;
+  QualityGovernor governor(options.targetFrameMs, options.minQuality);
+  GlRenderer gl(options.wid, options.hei);
+  app.attach(gl);
+  unique_ptr<SoftwareRenderer> software; // only with --renderer software
+  if (options.software) {
+    software.reset(new SoftwareRenderer(options.wid, options.hei,
+                                        &app.getScheduler(),
+                                        options.supersample,
+                                        options.downsample));
+    app.attach(*software);
+  }
+  BloomFilter bloom(app.getScheduler(), options.bloomRadius,
+                    options.bloomIntensity);
+  int frames = 0;
   while (true) { // main app loop
     FsPollDevice();
     if (FSKEY_ESC == FsInkey()) {
       break;
     }
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-    app.update();
-    app.draw();
+    auto frameStart = chrono::steady_clock::now();
+    int steps = clock.advance();
+    for (int i = 0; i < steps; ++i) {
+      app.update();
+    }
+    if (software) {
+      app.draw(*software, clock.getAlpha());
+      if (options.bloomRadius > 0) {
+        bloom.apply(software->getPixels(), software->getWidth(),
+                    software->getHeight());
+      }
+      software->present();
+    } else {
+      app.draw(gl, clock.getAlpha());
+    }
+    ++frames;
+    if (options.targetFrameMs > 0) {
+      chrono::duration<double, milli> frameTime =
+          chrono::steady_clock::now() - frameStart;
+      if (governor.record(frameTime.count())) {
+        app.setQuality(governor.getSettings());
+        showQualityLevel(governor.getLevel());
+      }
+    }
+    FsSwapBuffers();
+    if (steps == 0) {
+      FsSleep(1);
+    }
+  }
+  printf("sound cache: %d hits, %d misses\n", app.getSounds().getHits(),
+         app.getSounds().getMisses());
+  if (frames > 0) {
+    printf("draw calls: %.1f per frame\n",
+           double(app.getDrawCalls()) / frames);
+  }
+  printBloomTimings(bloom);
+}
+
+// message from the main thread to the simulation thread
+struct ShowCommand {
+  enum Type { QUIT, QUALITY };
+  Type type;
+  int level; // quality level, for QUALITY
+};
+
+// runs the show in a window in real time, with the updates on a thread of
+// their own. after every batch of updates the simulation thread captures a
+// snapshot of the show and publishes it through a triple buffer; the main
+// thread draws the latest snapshot, plays the sounds the updates queued, and
+// sends input and quality changes back through a queue. a slow frame or
+// buffer swap then no longer holds up the show. snapshots are taken at whole
+// updates, so frames are not interpolated
+void runThreaded(const ShowOptions &options) {
+  FsOpenWindow(0, 0, options.wid, options.hei, 1);
+  Demo app(options, true);
+  // the renderer gets threads of its own, so drawing does not wait for the
+  // updates to finish with theirs
+  TaskScheduler renderThreads(options.numThreads);
+  QualityGovernor governor(options.targetFrameMs, options.minQuality);
+  GlRenderer gl(options.wid, options.hei);
+  app.attach(gl);
+  unique_ptr<SoftwareRenderer> software; // only with --renderer software
+  if (options.software) {
+    software.reset(new SoftwareRenderer(options.wid, options.hei,
+                                        &renderThreads, options.supersample,
+                                        options.downsample));
+    app.attach(*software);
+  }
+  BloomFilter bloom(renderThreads, options.bloomRadius,
+                    options.bloomIntensity);
+  SpscQueue<SharedSound *> sounds(SOUND_QUEUE_SIZE);
+  SpscQueue<ShowCommand> commands(COMMAND_QUEUE_SIZE);
+  TripleBuffer<RenderSnapshot> snapshots;
+  app.setSoundQueue(&sounds);
+  app.capture(snapshots.back(), 1.0, true);
+  snapshots.publish();
+
+  thread simulation([&] {
+    SimulationClock clock;
+    while (true) {
+      ShowCommand command;
+      bool quit = false;
+      while (commands.pop(command)) {
+        if (command.type == ShowCommand::QUIT) {
+          quit = true;
+        } else {
+          app.setQuality(QUALITY_LEVELS[command.level]);
+        }
+      }
+      if (quit) {
+        break;
+      }
+      int steps = clock.advance();
+      for (int i = 0; i < steps; ++i) {
+        app.update();
+      }
+      if (steps > 0) {
+        app.capture(snapshots.back(), 1.0, true);
+        snapshots.publish();
+      } else {
+        this_thread::sleep_for(chrono::milliseconds(1));
+      }
+    }
+  });
+
+  int sentLevel = governor.getLevel(); // quality level the simulation has
+  int frames = 0;
+  long long drawCalls = 0;
+  while (true) {
+    FsPollDevice();
+    if (FSKEY_ESC == FsInkey()) {
+      ShowCommand quit = {ShowCommand::QUIT, 0};
+      while (!commands.push(quit)) {
+        this_thread::yield();
+      }
+      break;
+    }
+    auto frameStart = chrono::steady_clock::now();
+    app.playQueuedSounds();
+    bool fresh = snapshots.update();
+    if (software) {
+      drawCalls += snapshots.front().draw(*software);
+      if (options.bloomRadius > 0) {
+        bloom.apply(software->getPixels(), software->getWidth(),
+                    software->getHeight());
+      }
+      software->present();
+    } else {
+      drawCalls += snapshots.front().draw(gl);
+    }
+    ++frames;
+    if (options.targetFrameMs > 0) {
+      chrono::duration<double, milli> frameTime =
+          chrono::steady_clock::now() - frameStart;
+      if (governor.record(frameTime.count())) {
+        showQualityLevel(governor.getLevel());
+      }
+      // a change that does not fit in the queue is sent again next frame
+      if (sentLevel != governor.getLevel()) {
+        ShowCommand change = {ShowCommand::QUALITY, governor.getLevel()};
+        if (commands.push(change)) {
+          sentLevel = governor.getLevel();
+        }
+      }
+    }
     FsSwapBuffers();
-    FsSleep(10);
+    if (!fresh) {
+      FsSleep(1);
+    }
+  }
+  simulation.join();
+  printf("sound cache: %d hits, %d misses\n", app.getSounds().getHits(),
+         app.getSounds().getMisses());
+  if (frames > 0) {
+    printf("draw calls: %.1f per frame\n", double(drawCalls) / frames);
+  }
+  printBloomTimings(bloom);
+}
+
+// prints how the primitives of the last frame were spread over the tiles
+void printTileStats(const SoftwareRenderer &renderer) {
+  const auto &stats = renderer.getTileStats();
+  int total = 0, busiest = 0;
+  double ms = 0, slowest = 0;
+  for (const auto &tile : stats) {
+    int primitives = tile.points + tile.lines + tile.fills;
+    total += primitives;
+    busiest = max(busiest, primitives);
+    ms += tile.ms;
+    slowest = max(slowest, tile.ms);
+  }
+  printf("last frame: %dx%d tiles of %d pixels, %.1f primitives per tile"
+         " (at most %d), %.3f ms per tile (at most %.3f)\n",
+         renderer.getTilesX(), renderer.getTilesY(), TILE_SIZE,
+         double(total) / stats.size(), busiest, ms / stats.size(), slowest);
+}
+
+// runs a number of simulation steps as fast as possible without a window
+void runHeadless(const ShowOptions &options) {
+  Demo app(options, false);
+  unique_ptr<SoftwareRenderer> software; // only with --renderer software
+  unique_ptr<BloomFilter> bloom;
+  if (options.software) {
+    software.reset(new SoftwareRenderer(options.wid, options.hei,
+                                        &app.getScheduler(),
+                                        options.supersample,
+                                        options.downsample));
+    app.attach(*software);
+    bloom.reset(new BloomFilter(app.getScheduler(), options.bloomRadius,
+                                options.bloomIntensity));
+  }
+  long long start = FsSubSecondTimer();
+  for (int i = 0; i < options.headlessSteps; ++i) {
+    app.update();
+    if (software) {
+      app.draw(*software, 1.0);
+      if (options.bloomRadius > 0) {
+        bloom->apply(software->getPixels(), software->getWidth(),
+                     software->getHeight());
+      }
+    }
+  }
+  long long elapsed = max(FsSubSecondTimer() - start, 1LL);
+  printf("simulated %d steps in %lld ms (%.1f steps/s, %.1fx real time)\n",
+         options.headlessSteps, elapsed,
+         options.headlessSteps * 1000.0 / elapsed,
+         double(options.headlessSteps) * SIM_STEP_MS / elapsed);
+  if (software) {
+    printf("drew %d %dx%d frames on the CPU\n", options.headlessSteps,
+           software->getWidth(), software->getHeight());
+    printTileStats(*software);
+    printBloomTimings(*bloom);
+  }
+}
+
+// draws a smooth point the direct way, evaluating the coverage of every pixel
+// around it, as the reference the stamps are timed against
+void drawSmoothPointDirect(unsigned char rgba[], int wid, int hei,
+                           const BatchVertex &v, float size) {
+  const float radius = size * 0.5f;
+  const float color[4] = {v.r, v.g, v.b, v.a};
+  const int x0 = max(int(floorf(v.x - radius - 0.5f)), 0);
+  const int y0 = max(int(floorf(v.y - radius - 0.5f)), 0);
+  const int x1 = min(int(ceilf(v.x + radius + 0.5f)), wid);
+  const int y1 = min(int(ceilf(v.y + radius + 0.5f)), hei);
+  for (int py = y0; py < y1; ++py) {
+    for (int px = x0; px < x1; ++px) {
+      const float coverage =
+          pointCoverage(px + 0.5f - v.x, py + 0.5f - v.y, radius);
+      if (coverage > 0) {
+        stampKernelScalar(&rgba[(size_t(py) * wid + px) * 4], &coverage, 1,
+                          color);
+      }
+    }
+  }
+}
+
+// times drawing the same random smooth points with the stamps of the
+// SoftwareRenderer and directly, and reports how far the two images differ
+void runPointBenchmark(const ShowOptions &options) {
+  // the points are placed in world units; the direct drawing gets them in
+  // the pixels of the frame
+  const float scale = float(options.hei) / HEIGHT;
+  Pcg32 rng(options.seed);
+  vector<BatchVertex> points(options.pointBenchmark);
+  for (auto &v : points) {
+    v.x = float(randRange(rng, 0, options.wid / scale));
+    v.y = float(randRange(rng, 0, HEIGHT));
+    v.r = float(randRange(rng, 0.5, 1));
+    v.g = float(randRange(rng, 0.5, 1));
+    v.b = float(randRange(rng, 0.5, 1));
+    v.a = float(randRange(rng, 0.2, 1));
+  }
+  SoftwareRenderer renderer(options.wid, options.hei);
+  renderer.setBackground(Color(0, 0, 0), Color(0, 0, 0));
+  renderer.setSmoothPoints(true);
+  renderer.beginFrame();
+  vector<unsigned char> reference(renderer.getPixels(),
+                                  renderer.getPixels() +
+                                      size_t(options.wid) * options.hei * 4);
+
+  auto start = chrono::steady_clock::now();
+  renderer.drawPoints(points.data(), points.size(), PARTICLE_SIZE);
+  renderer.endFrame();
+  chrono::duration<double, milli> stampMs = chrono::steady_clock::now() - start;
+
+  start = chrono::steady_clock::now();
+  for (BatchVertex v : points) {
+    v.x *= scale;
+    v.y *= scale;
+    drawSmoothPointDirect(reference.data(), options.wid, options.hei, v,
+                          PARTICLE_SIZE * scale);
+  }
+  chrono::duration<double, milli> directMs =
+      chrono::steady_clock::now() - start;
+
+  int largest = 0;
+  double total = 0;
+  for (size_t i = 0; i < reference.size(); ++i) {
+    const int difference = abs(int(renderer.getPixels()[i]) - reference[i]);
+    largest = max(largest, difference);
+    total += difference;
+  }
+  const double n = options.pointBenchmark;
+  printf("stamped %d points of size %.1f on %dx%d in %.2f ms (%.1f M "
+         "points/s)\n",
+         options.pointBenchmark, PARTICLE_SIZE * scale, options.wid,
+         options.hei, stampMs.count(), n / stampMs.count() / 1000.0);
+  printf("per-pixel coverage took %.2f ms (%.1f M points/s), %.2fx the"
+         " stamps, which are off by %d at most (of 255)\n",
+         directMs.count(), n / directMs.count() / 1000.0,
+         directMs.count() / max(stampMs.count(), 1e-6), largest);
+  printf("images differ by %.4f on average\n", total / reference.size());
+}
+
+// counts the bytes the inflater hands out, and throws them away
+class PngByteCounter : public YsGenericPngDecoder {
+public:
+  size_t bytes = 0;
+
+  int OutputSpan(const unsigned char[], size_t n) override {
+    bytes += n;
+    return YSOK;
+  }
+};
+
+// counts the lines the decoder completes, and how many bytes of the file
+// had been pushed when the first one was done
+class PngLineCounter : public YsRawPngDecoder {
+public:
+  size_t pushed = 0;
+  size_t firstLinePushed = 0;
+  int lines = 0;
+
+  int LineCompleted(int) override {
+    if (lines++ == 0) {
+      firstLinePushed = pushed;
+    }
+    return YSOK;
+  }
+};
+
+// checks the SIMD unfilters of the decoder against the scalar one, then
+// times decoding the skyline from memory: the inflater alone, the whole
+// decode into RGBA pixels, and the decode of the file pushed in pieces
+void runPngBenchmark(const ShowOptions &options) {
+  printf("SIMD unfilters %s the scalar unfilter\n",
+         YsPngCheckUnfilter() == YSOK ? "match" : "DO NOT MATCH");
+  const char *filename = "skyline.png";
+  FILE *fp = fopen(filename, "rb");
+  if (fp == nullptr) {
+    printf("cannot open %s\n", filename);
+    return;
+  }
+  vector<unsigned char> file;
+  unsigned char buf[4096];
+  for (size_t n; (n = fread(buf, 1, sizeof(buf), fp)) > 0;) {
+    file.insert(file.end(), buf, buf + n);
+  }
+  fclose(fp);
+
+  size_t inflated = 0;
+  auto start = chrono::steady_clock::now();
+  for (int i = 0; i < options.pngBenchmark; ++i) {
+    YsPngBinaryMemoryStream stream(file.size(), file.data());
+    PngByteCounter png;
+    png.Decode(stream);
+    inflated = png.bytes;
+  }
+  chrono::duration<double, milli> inflateMs =
+      chrono::steady_clock::now() - start;
+
+  int wid = 0, hei = 0;
+  start = chrono::steady_clock::now();
+  for (int i = 0; i < options.pngBenchmark; ++i) {
+    YsPngBinaryMemoryStream stream(file.size(), file.data());
+    YsRawPngDecoder png;
+    png.Decode(stream);
+    wid = png.wid;
+    hei = png.hei;
+  }
+  chrono::duration<double, milli> decodeMs =
+      chrono::steady_clock::now() - start;
+
+  const size_t piece = 4096;
+  size_t firstLine = 0;
+  int lines = 0;
+  start = chrono::steady_clock::now();
+  for (int i = 0; i < options.pngBenchmark; ++i) {
+    PngLineCounter png;
+    png.BeginIncrementalDecode();
+    while (png.pushed < file.size()) {
+      const size_t n = min(piece, file.size() - png.pushed);
+      png.pushed += n;
+      if (png.PushData(file.data() + png.pushed - n, n) != YSOK) {
+        break;
+      }
+    }
+    png.EndIncrementalDecode();
+    firstLine = png.firstLinePushed;
+    lines = png.lines;
+  }
+  chrono::duration<double, milli> pushMs = chrono::steady_clock::now() - start;
+
+  const double n = options.pngBenchmark;
+  printf("%s: %d x %d, %zu bytes compressed\n", filename, wid, hei,
+         file.size());
+  printf("inflated %d times in %.2f ms each (%.1f MB/s)\n",
+         options.pngBenchmark, inflateMs.count() / n,
+         inflated * n / inflateMs.count() / 1000.0);
+  printf("decoded %d times in %.2f ms each (%.1f M pixels/s)\n",
+         options.pngBenchmark, decodeMs.count() / n,
+         double(wid) * hei * n / decodeMs.count() / 1000.0);
+  printf("pushed in %zu-byte pieces in %.2f ms each, %d lines, the first "
+         "after %zu bytes\n",
+         piece, pushMs.count() / n, lines, firstLine);
+}
+
+// renders frames at a fixed frame rate, independent of how fast they are
+// drawn, and streams them to the output. messages go to stderr, since the
+// frames may be going to stdout
+bool runRender(const ShowOptions &options) {
+  Demo app(options, false);
+  SoftwareRenderer renderer(options.wid, options.hei, &app.getScheduler(),
+                            options.supersample, options.downsample);
+  app.attach(renderer);
+  BloomFilter bloom(app.getScheduler(), options.bloomRadius,
+                    options.bloomIntensity);
+  FrameWriter writer(options.y4m, options.wid, options.hei);
+  if (!writer.open(options.output, options.fps)) {
+    fprintf(stderr, "cannot open %s\n", options.output);
+    return false;
+  }
+  const long long stepsPerSecond = 1000 / SIM_STEP_MS;
+  long long steps = 0;
+  long long start = FsSubSecondTimer();
+  for (int frame = 0; frame < options.renderFrames; ++frame) {
+    // frame f shows the show f / fps seconds in
+    const long long target = frame * stepsPerSecond;
+    while (steps < target / options.fps) {
+      app.update();
+      ++steps;
+    }
+    app.draw(renderer, double(target % options.fps) / options.fps);
+    if (options.bloomRadius > 0) {
+      bloom.apply(renderer.getPixels(), renderer.getWidth(),
+                  renderer.getHeight());
+    }
+    writer.submit(renderer.getPixels());
+  }
+  if (!writer.close()) {
+    fprintf(stderr, "writing %s failed\n", options.output);
+    return false;
+  }
+  long long elapsed = max(FsSubSecondTimer() - start, 1LL);
+  fprintf(stderr,
+          "rendered %d %dx%d frames in %lld ms (%.1f frames/s, %.1fx real"
+          " time)\n",
+          options.renderFrames, options.wid, options.hei, elapsed,
+          options.renderFrames * 1000.0 / elapsed,
+          options.renderFrames * 1000.0 / options.fps / elapsed);
+  return true;
+}
+
+int main(int argc, char *argv[]) {
+  ShowOptions options;
+  if (!options.parse(argc, argv)) {
+    ShowOptions::printUsage(argv[0]);
+    return 1;
+  }
+  fprintf(options.renderFrames > 0 ? stderr : stdout, "show seed: %llu\n",
+          (unsigned long long)options.seed);
+  if (options.renderFrames > 0) {
+    return runRender(options) ? 0 : 1;
+  } else if (options.pointBenchmark > 0) {
+    runPointBenchmark(options);
+  } else if (options.pngBenchmark > 0) {
+    runPngBenchmark(options);
+  } else if (options.headlessSteps > 0) {
+    runHeadless(options);
+  } else if (options.simThread) {
+    runThreaded(options);
+  } else {
+    runWindowed(options);
   }
   return 0;
 }
@@ -28,9 +28,15 @@ OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 //////////////////////////////////////////////////////////// */
 
 #include <stdio.h>
+#include <string.h>
 
 #include "yspng.h"
 
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define YSPNG_X86_SIMD
+#include <immintrin.h>
+#endif
+
 
 
 unsigned int YsGenericPngDecoder::verboseMode=YSFALSE;
@@ -72,6 +78,14 @@ unsigned int YsGenericPngDecoder::verboseMode=YSFALSE;
 //     1bit Indexed Color was already supported.  I was forgetting to add in the list below.
 //   2014/12/21
 //     Small improvement in the de-compression efficiency.
+//   2026/10/17
+//     Huffman codes are decoded by look-up tables instead of walking the Huffman tree bit by bit.
+//     Bits are read through a 64-bit accumulator instead of one bit at a time.
+//     De-compressed bytes are given to the decoder in spans (OutputSpan), and lines are unfiltered and converted at once.
+//     SSE2/SSSE3/AVX2 unfilter for 3- and 4-byte pixels, chosen at run time.  YsPngCheckUnfilter compares them against the scalar version.
+//     Incremental decoding (BeginIncrementalDecode, PushData, EndIncrementalDecode).  IDAT chunks are de-compressed as they arrive.
+//     Decode reads the file in pieces instead of staging all IDAT chunks in a buffer of the file size.
+//     YsRawPngDecoder::LineCompleted is called for each line completed.
 
 /* Supported color and depth
 
@@ -273,9 +287,22 @@ size_t YsPngBinaryMemoryStream::Read(unsigned char buf[],size_t readSize)
 
 ////////////////////////////////////////////////////////////
 
+static const unsigned char YsPngSignature[8]={0x89,0x50,0x4e,0x47,0x0d,0x0a,0x1a,0x0a};
+
 YsGenericPngDecoder::YsGenericPngDecoder()
 {
+	chunkBuf=NULL;
+	uncompressor.output=this;
 	Initialize();
+	BeginIncrementalDecode();
+}
+
+YsGenericPngDecoder::~YsGenericPngDecoder()
+{
+	if(chunkBuf!=NULL)
+	{
+		delete [] chunkBuf;
+	}
 }
 
 void YsGenericPngDecoder::Initialize(void)
@@ -289,9 +316,7 @@ void YsGenericPngDecoder::Initialize(void)
 int YsGenericPngDecoder::CheckSignature(YsPngGenericBinaryStream &binStream)
 {
 	unsigned char buf[8];
-	binStream.Read(buf,8);
-	if(buf[0]==0x89 && buf[1]==0x50 && buf[2]==0x4e && buf[3]==0x47 && 
-	   buf[4]==0x0d && buf[5]==0x0a && buf[6]==0x1a && buf[7]==0x0a)
+	if(binStream.Read(buf,8)==8 && 0==memcmp(buf,YsPngSignature,8))
 	{
 		return YSOK;
 	}
@@ -343,35 +368,205 @@ int YsGenericPngDecoder::ReadChunk(unsigned &length,unsigned char *&buf,unsigned
 
 ////////////////////////////////////////////////////////////
 
-int YsPngHuffmanTree::leakTracker=0;
+YsPngBitReader::YsPngBitReader()
+{
+	dat=NULL;
+	length=0;
+	bytePtr=0;
+	bitBuf=0;
+	nBitBuf=0;
+}
+
+YsPngBitReader::YsPngBitReader(unsigned length,const unsigned char dat[])
+{
+	this->dat=dat;
+	this->length=length;
+	bytePtr=0;
+	bitBuf=0;
+	nBitBuf=0;
+}
+
+////////////////////////////////////////////////////////////
+
+// See RFC1951 Specification 3.2.5
+static const unsigned short YsPngCopyLengthBase[29]=
+{
+	3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258
+};
+static const unsigned char YsPngCopyLengthExtraBits[29]=
+{
+	0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0
+};
+static const unsigned short YsPngBackwardDistanceBase[30]=
+{
+	1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577
+};
+static const unsigned char YsPngBackwardDistanceExtraBits[30]=
+{
+	0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13
+};
 
-YsPngHuffmanTree::YsPngHuffmanTree()
+YsPngHuffmanTable::YsPngHuffmanTable()
 {
-	zeroOne[0]=NULL;
-	zeroOne[1]=NULL;
-	dat=0x7fffffff;
-	weight=0;
-	depth=1;
-	leakTracker++;
+	entry=NULL;
+	nEntryAlloc=0;
 }
 
-YsPngHuffmanTree::~YsPngHuffmanTree()
+YsPngHuffmanTable::~YsPngHuffmanTable()
 {
-	leakTracker--;
+	if(entry!=NULL)
+	{
+		delete [] entry;
+	}
 }
 
-void YsPngHuffmanTree::DeleteHuffmanTree(YsPngHuffmanTree *node)
+int YsPngHuffmanTable::Make
+   (unsigned n,const unsigned hLength[],const unsigned hCode[],
+    unsigned nSymbol,unsigned nBase,const unsigned short base[],const unsigned char extraBits[])
 {
-	if(node!=NULL)
+	const unsigned primarySize=(1<<primaryBits);
+	unsigned i,j,nEntry,subTop;
+	unsigned revCode[288],subBits[1<<primaryBits];
+
+	if(288<n)
+	{
+		return YSERR;
+	}
+
+	// The codes are stored from the most-significant bit, but the stream is read from the least-significant bit.
+	for(i=0; i<primarySize; i++)
+	{
+		subBits[i]=0;
+	}
+	for(i=0; i<n; i++)
+	{
+		if(maxCodeLength<hLength[i])
+		{
+			return YSERR;
+		}
+		revCode[i]=0;
+		for(j=0; j<hLength[i]; j++)
+		{
+			if(hCode[i]&(1<<j))
+			{
+				revCode[i]|=(1<<(hLength[i]-1-j));
+			}
+		}
+		if(primaryBits<hLength[i])
+		{
+			unsigned prefix;
+			prefix=revCode[i]&(primarySize-1);
+			if(subBits[prefix]<hLength[i]-primaryBits)
+			{
+				subBits[prefix]=hLength[i]-primaryBits;
+			}
+		}
+	}
+
+	nEntry=primarySize;
+	for(i=0; i<primarySize; i++)
+	{
+		if(0<subBits[i])
+		{
+			nEntry+=(1<<subBits[i]);
+		}
+	}
+	if(nEntryAlloc<nEntry)
+	{
+		if(entry!=NULL)
+		{
+			delete [] entry;
+		}
+		entry=new unsigned int [nEntry];
+		nEntryAlloc=nEntry;
+	}
+	for(i=0; i<nEntry; i++)
+	{
+		entry[i]=(INVALID<<24);
+	}
+
+	subTop=primarySize;
+	for(i=0; i<primarySize; i++)
+	{
+		if(0<subBits[i])
+		{
+			entry[i]=(SUBTABLE<<24)|(subBits[i]<<20)|(primaryBits<<16)|subTop;
+			subTop+=(1<<subBits[i]);
+		}
+	}
+
+	for(i=0; i<n; i++)
 	{
-		DeleteHuffmanTree(node->Zero());
-		DeleteHuffmanTree(node->One());
-		delete node;
+		const unsigned len=hLength[i];
+		unsigned e;
+		if(0==len)
+		{
+			continue;
+		}
+
+		if(i<nSymbol)
+		{
+			e=(SYMBOL<<24)|(len<<16)|i;
+		}
+		else if(i-nSymbol<nBase)
+		{
+			e=(BASE<<24)|(extraBits[i-nSymbol]<<20)|(len<<16)|base[i-nSymbol];
+		}
+		else
+		{
+			e=(INVALID<<24)|(len<<16);
+		}
+
+		if(len<=primaryBits)
+		{
+			for(j=revCode[i]; j<primarySize; j+=(1<<len))
+			{
+				if(SUBTABLE==GetKind(entry[j]))
+				{
+					return YSERR;  // Over-subscribed code lengths.
+				}
+				entry[j]=e;
+			}
+		}
+		else
+		{
+			const unsigned link=entry[revCode[i]&(primarySize-1)];
+			if(SUBTABLE!=GetKind(link))
+			{
+				return YSERR;
+			}
+			for(j=(revCode[i]>>primaryBits); j<(1u<<GetExtraBits(link)); j+=(1<<(len-primaryBits)))
+			{
+				entry[GetValue(link)+j]=e;
+			}
+		}
 	}
+
+	return YSOK;
 }
 
 ////////////////////////////////////////////////////////////
 
+YsPngUncompressor::YsPngUncompressor()
+{
+	output=NULL;
+	windowBuf=NULL;
+	inBuf=NULL;
+	BeginUncompress();
+}
+
+YsPngUncompressor::~YsPngUncompressor()
+{
+	if(NULL!=windowBuf)
+	{
+		delete [] windowBuf;
+	}
+	if(NULL!=inBuf)
+	{
+		delete [] inBuf;
+	}
+}
+
 void YsPngUncompressor::MakeFixedHuffmanCode(unsigned hLength[288],unsigned hCode[288])
 {
 	unsigned i;
@@ -467,16 +662,16 @@ int YsPngUncompressor::DecodeDynamicHuffmanCode
 	    unsigned int *&hLengthLiteral,unsigned int *&hCodeLiteral,
 	    unsigned int *&hLengthDist,unsigned int *&hCodeDist,
 	    unsigned int hLengthBuf[322],unsigned int hCodeBuf[322],
-	    const unsigned char dat[],unsigned int &bytePtr,unsigned int &bitPtr)
+	    YsPngBitReader &reader)
 {
 	unsigned int i;
 	hLit=0;
 	hDist=0;
 	hCLen=0;
 
-	hLit=GetNextMultiBit(dat,bytePtr,bitPtr,5);
-	hDist=GetNextMultiBit(dat,bytePtr,bitPtr,5);
-	hCLen=GetNextMultiBit(dat,bytePtr,bitPtr,4);
+	hLit=reader.GetBits(5);
+	hDist=reader.GetBits(5);
+	hCLen=reader.GetBits(4);
 
 	if(YsGenericPngDecoder::verboseMode==YSTRUE)
 	{
@@ -495,7 +690,7 @@ int YsPngUncompressor::DecodeDynamicHuffmanCode
 	}
 	for(i=0; i<hCLen+4; i++)
 	{
-		codeLengthCode[codeLengthOrder[i]]=GetNextMultiBit(dat,bytePtr,bitPtr,3);
+		codeLengthCode[codeLengthOrder[i]]=reader.GetBits(3);
 		// printf("Code length code[%d]=%d (for %d)\n",
 		//     codeLengthOrder[i],codeLengthCode[i],codeLengthOrder[i]);
 	}
@@ -521,62 +716,69 @@ int YsPngUncompressor::DecodeDynamicHuffmanCode
 	hLengthDist=hLengthBuf+hLit+257;
 	hCodeDist=hCodeBuf+hLit+257;
 
-	YsPngHuffmanTree *lengthTree,*lengthTreePtr;
-	lengthTree=MakeHuffmanTree(codeLengthLen,hLengthCode,hCodeCode);
+	YsPngHuffmanTable lengthTable;
+	if(lengthTable.Make(codeLengthLen,hLengthCode,hCodeCode,codeLengthLen,0,NULL,NULL)!=YSOK)
+	{
+		return YSERR;
+	}
 
+	const unsigned int nLength=hLit+257+hDist+1;
 	unsigned int nExtr;
 	nExtr=0;
-	lengthTreePtr=lengthTree;
-	while(nExtr<hLit+257+hDist+1)
+	while(nExtr<nLength)
 	{
-		lengthTreePtr=lengthTreePtr->Traverse(GetNextBit(dat,bytePtr,bitPtr));
-		if(lengthTreePtr->Zero()==NULL && lengthTreePtr->One()==NULL)
+		unsigned e,value,copyLength;
+		reader.Refill();
+		e=lengthTable.Lookup(reader.Peek(YsPngHuffmanTable::maxCodeLength));
+		if(YsPngHuffmanTable::SYMBOL!=YsPngHuffmanTable::GetKind(e) || reader.length<=reader.GetBytePtr())
 		{
-			unsigned value,copyLength;
-			value=lengthTreePtr->dat;
+			return YSERR;
+		}
+		reader.Consume(YsPngHuffmanTable::GetCodeLength(e));
+		value=YsPngHuffmanTable::GetValue(e);
 
-			// printf("Value=%d\n",value);
+		// printf("Value=%d\n",value);
 
-			if(value<=15)
-			{
-				hLengthBuf[nExtr++]=value;
-			}
-			else if(value==16)
+		if(value<=15)
+		{
+			hLengthBuf[nExtr++]=value;
+		}
+		else
+		{
+			unsigned int repeat;
+			if(value==16)
 			{
-				copyLength=3+GetNextMultiBit(dat,bytePtr,bitPtr,2);
-				// printf("copyLength=%d\n",copyLength);
-				while(copyLength>0)
+				if(0==nExtr)
 				{
-					hLengthBuf[nExtr]=hLengthBuf[nExtr-1];
-					nExtr++;
-					copyLength--;
+					return YSERR;
 				}
+				copyLength=3+reader.GetBits(2);
+				repeat=hLengthBuf[nExtr-1];
 			}
 			else if(value==17)
 			{
-				copyLength=3+GetNextMultiBit(dat,bytePtr,bitPtr,3);
-				// printf("copyLength=%d\n",copyLength);
-				while(copyLength>0)
-				{
-					hLengthBuf[nExtr++]=0;
-					copyLength--;
-				}
+				copyLength=3+reader.GetBits(3);
+				repeat=0;
 			}
-			else if(value==18)
+			else
 			{
-				copyLength=11+GetNextMultiBit(dat,bytePtr,bitPtr,7);
-				// printf("copyLength=%d\n",copyLength);
-				while(copyLength>0)
-				{
-					hLengthBuf[nExtr++]=0;
-					copyLength--;
-				}
+				copyLength=11+reader.GetBits(7);
+				repeat=0;
 			}
+			// printf("copyLength=%d\n",copyLength);
 
-			lengthTreePtr=lengthTree;
-
-			// printf("nExtr=%d/%d\n",nExtr,hLit+257+hDist+1);
+			if(nLength<nExtr+copyLength)
+			{
+				return YSERR;
+			}
+			while(copyLength>0)
+			{
+				hLengthBuf[nExtr++]=repeat;
+				copyLength--;
+			}
 		}
+
+		// printf("nExtr=%d/%d\n",nExtr,hLit+257+hDist+1);
 	}
 
 	if(YSTRUE==YsGenericPngDecoder::verboseMode)
@@ -598,390 +800,495 @@ int YsPngUncompressor::DecodeDynamicHuffmanCode
 	MakeDynamicHuffmanCode(hLengthLiteral,hCodeLiteral,hLit+257,hLengthLiteral);
 	MakeDynamicHuffmanCode(hLengthDist,hCodeDist,hDist+1,hLengthDist);
 
-	DeleteHuffmanTree(lengthTree);
-
 	return YSOK;
 }
 
-YsPngHuffmanTree *YsPngUncompressor::MakeHuffmanTree(unsigned n,unsigned hLength[],unsigned hCode[])
-{
-	unsigned i,j,mask;
-	YsPngHuffmanTree *root,*ptr;
-	root=new YsPngHuffmanTree;
-
-	for(i=0; i<n; i++)
-	{
-		if(hLength[i]>0)
-		{
-			ptr=root;
-			mask=(1<<(hLength[i]-1));
-			for(j=0; j<hLength[i]; j++)
-			{
-				if(hCode[i]&mask)
-				{
-					if(ptr->One()==NULL)
-					{
-						ptr->One()=new YsPngHuffmanTree;
-					}
-					ptr=ptr->One();
-				}
-				else
-				{
-					if(ptr->Zero()==NULL)
-					{
-						ptr->Zero()=new YsPngHuffmanTree;
-					}
-					ptr=ptr->Zero();
-				}
-				mask>>=1;
-			}
-			ptr->dat=i;
-		}
-	}
-
-	return root;
-}
-
-void YsPngUncompressor::DeleteHuffmanTree(YsPngHuffmanTree *node)
-{
-	YsPngHuffmanTree::DeleteHuffmanTree(node);
-}
-
-unsigned YsPngUncompressor::GetCopyLength(unsigned value,unsigned char dat[],unsigned &bytePtr,unsigned &bitPtr)
-{
-	unsigned copyLength;
-
-	if(value<=264)
-	{
-		copyLength=3+(value-257);
-	}
-	else if(value>=285)
-	{
-		copyLength=258;
-	}
-	else
-	{
-		unsigned base,offset,extBits;
-		extBits=1+(value-265)/4;
-		base=(8<<((value-265)/4))+3;
-		offset=((value-265)&3)*(2<<((value-265)/4));
-
-		copyLength=GetNextMultiBit(dat,bytePtr,bitPtr,extBits);
-		copyLength+=base+offset;
-	}
-
-	return copyLength;
-}
-
-unsigned YsPngUncompressor::GetBackwardDistance
-   (unsigned distCode,unsigned char dat[],unsigned &bytePtr,unsigned &bitPtr)
+int YsPngUncompressor::FlushWindow(const unsigned char windowBuf[],unsigned &windowFlushed,unsigned &windowUsed,unsigned windowSize)
 {
-	unsigned backDist;
-
-	if(distCode<=3)
+	int res=YSOK;
+	if(windowFlushed<windowUsed)
 	{
-		backDist=distCode+1;
+		res=output->OutputSpan(windowBuf+windowFlushed,windowUsed-windowFlushed);
 	}
-	else
+	if(windowSize<=windowUsed)
 	{
-		unsigned base,offset,extBits;
-
-		base=(4<<((distCode-4)/2))+1;
-		offset=(distCode&1)*(2<<((distCode-4)/2));
-		extBits=(distCode-2)/2;
-
-		backDist=GetNextMultiBit(dat,bytePtr,bitPtr,extBits);
-		backDist+=base+offset;
+		windowUsed=0;
 	}
-
-	return backDist;
+	windowFlushed=windowUsed;
+	return res;
 }
 
-int YsPngUncompressor::Uncompress(unsigned length,unsigned char dat[])
+int YsPngUncompressor::Inflate(YSBOOL lastData)
 {
-	unsigned windowUsed;
-	unsigned char *windowBuf;
-	unsigned nByteExtracted;
-
-	YsPngHuffmanTree *codeTree=NULL;
-	YsPngHuffmanTree *distTree=NULL;
-
-
-	windowBuf=NULL;
-
-	unsigned bytePtr,bitPtr;
-	bytePtr=0;
-	bitPtr=1;
-	nByteExtracted=0;
-
-
-	if(YsGenericPngDecoder::verboseMode==YSTRUE)
-	{
-		printf("Begin zLib block length=%d bytePtr=%d bitPtr=0x%02x\n",length,bytePtr,bitPtr);
-	}
-
-	unsigned char cmf,flg;
-	cmf=dat[bytePtr++];
-	flg=dat[bytePtr++];
-
-	unsigned cm,cInfo,windowSize;
-	cm=cmf&0x0f;
-	if(cm!=8)
-	{
-		printf("Unsupported compression method! (%d)\n",cm);
-		goto ERREND;
-	}
-
-	cInfo=(cmf&0xf0)>>4;
-	windowSize=1<<(cInfo+8);
-
-	if(YsGenericPngDecoder::verboseMode==YSTRUE)
+	for(;;)
 	{
-		printf("cInfo=%d, Window Size=%d\n",cInfo,windowSize);
-	}
-
-	windowBuf=new unsigned char [windowSize];
-	windowUsed=0;
-
+		const unsigned int bytePtr=reader.GetBytePtr();
+		const unsigned int nByteLeft=(bytePtr<reader.length ? reader.length-bytePtr : 0);
 
+		switch(state)
+		{
+		case STATE_ZLIBHEADER:
+			if(YSTRUE!=lastData && nByteLeft<2)
+			{
+				goto FLUSHEND;
+			}
+			else
+			{
+				unsigned char cmf,flg;
+				cmf=(unsigned char)reader.GetBits(8);
+				flg=(unsigned char)reader.GetBits(8);
 
-	unsigned fCheck,fDict,fLevel;
-	fCheck=(flg&15);
-	fDict=(flg&32)>>5;
-	fLevel=(flg&192)>>6;
+				unsigned cm,cInfo;
+				cm=cmf&0x0f;
+				if(cm!=8)
+				{
+					printf("Unsupported compression method! (%d)\n",cm);
+					goto ERREND;
+				}
 
-	if(YsGenericPngDecoder::verboseMode==YSTRUE)
-	{
-		printf("fCheck=%d fDict=%d fLevel=%d\n",fCheck,fDict,fLevel);
-	}
+				cInfo=(cmf&0xf0)>>4;
+				windowSize=1<<(cInfo+8);
 
+				if(YsGenericPngDecoder::verboseMode==YSTRUE)
+				{
+					printf("cInfo=%d, Window Size=%d\n",cInfo,windowSize);
+				}
 
-	if(fDict!=0)
-	{
-		printf("PNG is not supposed to have a preset dictionary.\n");
-		goto ERREND;
-	}
+				windowBuf=new unsigned char [windowSize];
+				windowUsed=0;
+				windowFlushed=0;
 
 
-	YsPngHuffmanTree *codeTreePtr;
-	YsPngHuffmanTree *distTreePtr;
 
-	for(;;)
-	{
-		unsigned bFinal,bType;
+				unsigned fCheck,fDict,fLevel;
+				fCheck=(flg&15);
+				fDict=(flg&32)>>5;
+				fLevel=(flg&192)>>6;
 
-		bFinal=GetNextBit(dat,bytePtr,bitPtr);
-		bType=GetNextMultiBit(dat,bytePtr,bitPtr,2);
+				if(YsGenericPngDecoder::verboseMode==YSTRUE)
+				{
+					printf("fCheck=%d fDict=%d fLevel=%d\n",fCheck,fDict,fLevel);
+				}
 
-		if(bytePtr>=length)
-		{
-			printf("Buffer overflow\n");
-			goto ERREND;
-		}
 
-		if(YsGenericPngDecoder::verboseMode==YSTRUE)
-		{
-			printf("bFinal=%d bType=%d\n",bFinal,bType);
-		}
+				if(fDict!=0)
+				{
+					printf("PNG is not supposed to have a preset dictionary.\n");
+					goto ERREND;
+				}
+				state=STATE_BLOCKHEADER;
+			}
+			break;
 
-		if(bType==0) // No Compression
-		{
-			unsigned len;
-			if(bitPtr!=1)
+		case STATE_BLOCKHEADER:
+			if(YSTRUE!=lastData && nByteLeft<maxBlockHeaderLength)
 			{
-				bitPtr=1;
-				bytePtr++;
+				goto FLUSHEND;
 			}
-			if(bytePtr>=length)
+
+			bFinal=reader.GetBits(1);
+			bType=reader.GetBits(2);
+
+			if(reader.GetBytePtr()>=reader.length)
 			{
 				printf("Buffer overflow\n");
 				goto ERREND;
 			}
 
-			len=dat[bytePtr]+dat[bytePtr+1]*256;
-			bytePtr+=4;
-
-			// Feed len bytes
-
-			for(int i=0; i<(int)len; i++)  // 2010/02/08
+			if(YsGenericPngDecoder::verboseMode==YSTRUE)
 			{
-				output->Output(dat[bytePtr+i]);
-				windowBuf[windowUsed++]=dat[bytePtr+i];  // 2014/03/22
-				windowUsed&=(windowSize-1);              // 2014/03/22
+				printf("bFinal=%d bType=%d\n",bFinal,bType);
 			}
 
-			bytePtr+=len;
-		}
-		else if(bType==1 || bType==2)
-		{
-			codeTree=NULL;
-
-			if(bType==1)
+			if(bType==0) // No Compression
 			{
-				unsigned hLength[288],hCode[288];
-				MakeFixedHuffmanCode(hLength,hCode);
-				codeTree=MakeHuffmanTree(288,hLength,hCode);
-				distTree=NULL;
+				state=STATE_STOREDHEADER;
 			}
-			else
+			else if(bType==1)
 			{
-				unsigned hLit,hDist,hCLen;
-				unsigned *hLengthLiteral,*hCodeLiteral;
-				unsigned *hLengthDist,*hCodeDist;
-				unsigned hLengthBuf[322],hCodeBuf[322];
-
-				DecodeDynamicHuffmanCode
-				   (hLit,hDist,hCLen,
-				    hLengthLiteral,hCodeLiteral,hLengthDist,hCodeDist,hLengthBuf,hCodeBuf,
-				    dat,bytePtr,bitPtr);
-
-				if(YsGenericPngDecoder::verboseMode==YSTRUE)
+				unsigned hLength[288],hCode[288],hLengthDist[30],hCodeDist[30],i;
+				MakeFixedHuffmanCode(hLength,hCode);
+				for(i=0; i<30; i++)  // Distance codes are fixed 5 bits.
 				{
-					printf("Making Huffman Tree\n");
+					hLengthDist[i]=5;
 				}
-				codeTree=MakeHuffmanTree(hLit+257,hLengthLiteral,hCodeLiteral);
-				distTree=MakeHuffmanTree(hDist+1,hLengthDist,hCodeDist);
+				MakeDynamicHuffmanCode(hLengthDist,hCodeDist,30,hLengthDist);
+				codeTable.Make(288,hLength,hCode,257,29,YsPngCopyLengthBase,YsPngCopyLengthExtraBits);
+				distTable.Make(30,hLengthDist,hCodeDist,0,30,YsPngBackwardDistanceBase,YsPngBackwardDistanceExtraBits);
+				state=STATE_HUFFMAN;
 			}
-
-
-			if(YsGenericPngDecoder::verboseMode==YSTRUE)
+			else if(bType==2)
 			{
-				printf("Huffman table paprared\n");
+				state=STATE_DYNAMICHEADER;
 			}
-
-
-			codeTreePtr=codeTree;
-			if(codeTree!=NULL)
+			else
 			{
-				for(;;)
-				{
-					codeTreePtr=codeTreePtr->Traverse(GetNextBit(dat,bytePtr,bitPtr));
+				printf("Unknown compression type (bType=3)\n");
+				goto ERREND;
+			}
+			break;
+
+		case STATE_STOREDHEADER:
+			if(YSTRUE!=lastData && nByteLeft<maxStoredHeaderLength)
+			{
+				goto FLUSHEND;
+			}
+			else
+			{
+				unsigned ptr;
+				reader.AlignToByte();
+				ptr=reader.GetBytePtr();
+				if(ptr+4>reader.length)
+				{
+					printf("Buffer overflow\n");
+					goto ERREND;
+				}
+				storedLength=reader.dat[ptr]+reader.dat[ptr+1]*256;
+				reader.SeekByte(ptr+4);
+				state=STATE_STORED;
+			}
+			break;
 
-					if(codeTreePtr==NULL)
+		case STATE_STORED:
+			{
+				// Feed the bytes given so far.  The rest may come in the next piece.
+				unsigned len=storedLength;
+				if(nByteLeft<len)
+				{
+					if(YSTRUE==lastData)
 					{
-						printf("Huffman Decompression: Reached NULL node.\n");
+						printf("Buffer overflow\n");
 						goto ERREND;
 					}
+					len=nByteLeft;
+				}
 
-					if(codeTreePtr->Zero()==NULL && codeTreePtr->One()==NULL)
+				unsigned i,nCopy;
+				for(i=0; i<len; i+=nCopy)  // 2010/02/08
+				{
+					nCopy=len-i;
+					if(windowSize-windowUsed<nCopy)
 					{
-						// printf("[%d]\n",codeTreePtr->dat);
-
-						unsigned value;
-						value=codeTreePtr->dat;
-						if(value<256)
-						{
-							windowBuf[windowUsed++]=(unsigned char)value;
-							windowUsed&=(windowSize-1);
-							if(output->Output((unsigned char)value)!=YSOK)
-							{
-								goto ERREND;
-							}
-							nByteExtracted++;
-						}
-						else if(value==256)
-						{
-							break;
-						}
-						else if(value<=285)
-						{
-							unsigned copyLength,distCode,backDist;
-							copyLength=GetCopyLength(value,dat,bytePtr,bitPtr);
-							// printf("CopyLength %d\n",copyLength);
-
-							if(bType==1)
-							{
-								distCode=16*GetNextBit(dat,bytePtr,bitPtr);  // 5 bits fixed
-								distCode+=8*GetNextBit(dat,bytePtr,bitPtr);  // Reversed order
-								distCode+=4*GetNextBit(dat,bytePtr,bitPtr);
-								distCode+=2*GetNextBit(dat,bytePtr,bitPtr);
-								distCode+=  GetNextBit(dat,bytePtr,bitPtr);
-							}
-							else
-							{
-								distTreePtr=distTree;
-								while(distTreePtr->Zero()!=NULL || distTreePtr->One()!=NULL)
-								{
-									distTreePtr=distTreePtr->Traverse(GetNextBit(dat,bytePtr,bitPtr));
-								}
-								distCode=distTreePtr->dat;
-							}
-							backDist=GetBackwardDistance(distCode,dat,bytePtr,bitPtr);
-							// printf("DistCode %d BackDist %d\n",distCode,backDist);
-
-
-							unsigned i;
-							for(i=0; i<copyLength; i++)
-							{
-								unsigned char dat;
-								dat=windowBuf[(windowUsed-backDist)&(windowSize-1)];
-								if(output->Output(dat)!=YSOK)
-								{
-									goto ERREND;
-								}
-								nByteExtracted++;
-								windowBuf[windowUsed++]=dat;
-								windowUsed&=(windowSize-1);
-							}
-						}
-
-						codeTreePtr=codeTree;
+						nCopy=windowSize-windowUsed;
 					}
-
-					if(length<=bytePtr)
+					memcpy(windowBuf+windowUsed,reader.dat+bytePtr+i,nCopy);  // 2014/03/22
+					windowUsed+=nCopy;
+					if(windowSize<=windowUsed && FlushWindow(windowBuf,windowFlushed,windowUsed,windowSize)!=YSOK)
 					{
 						goto ERREND;
 					}
 				}
+				nByteExtracted+=len;
+				storedLength-=len;
+				reader.SeekByte(bytePtr+len);
+
+				if(0<storedLength)
+				{
+					goto FLUSHEND;
+				}
+				state=(bFinal!=0 ? STATE_END : STATE_BLOCKHEADER);
 			}
+			break;
 
+		case STATE_DYNAMICHEADER:
+			if(YSTRUE!=lastData && nByteLeft<maxDynamicHeaderLength)
+			{
+				goto FLUSHEND;
+			}
+			else
+			{
+				unsigned hLit,hDist,hCLen;
+				unsigned *hLengthLiteral,*hCodeLiteral;
+				unsigned *hLengthDist,*hCodeDist;
+				unsigned hLengthBuf[322],hCodeBuf[322];
+
+				if(DecodeDynamicHuffmanCode
+				   (hLit,hDist,hCLen,
+				    hLengthLiteral,hCodeLiteral,hLengthDist,hCodeDist,hLengthBuf,hCodeBuf,
+				    reader)!=YSOK)
+				{
+					printf("Broken dynamic Huffman code.\n");
+					goto ERREND;
+				}
+
+				if(YsGenericPngDecoder::verboseMode==YSTRUE)
+				{
+					printf("Making Huffman Table\n");
+				}
+				if(codeTable.Make(hLit+257,hLengthLiteral,hCodeLiteral,257,29,YsPngCopyLengthBase,YsPngCopyLengthExtraBits)!=YSOK ||
+				   distTable.Make(hDist+1,hLengthDist,hCodeDist,0,30,YsPngBackwardDistanceBase,YsPngBackwardDistanceExtraBits)!=YSOK)
+				{
+					printf("Broken dynamic Huffman code.\n");
+					goto ERREND;
+				}
+				state=STATE_HUFFMAN;
+			}
+			break;
 
-			DeleteHuffmanTree(codeTree);
-			DeleteHuffmanTree(distTree);
-			codeTree=NULL;
-			distTree=NULL;
+		case STATE_HUFFMAN:
+			if(InflateHuffman(lastData)!=YSOK)
+			{
+				goto ERREND;
+			}
+			if(STATE_HUFFMAN==state)
+			{
+				goto FLUSHEND;
+			}
+			break;
+
+		case STATE_END:
+			goto FLUSHEND;
+
+		default:
+			return YSERR;
 		}
-		else
+	}
+
+FLUSHEND:
+	if(windowBuf!=NULL && FlushWindow(windowBuf,windowFlushed,windowUsed,windowSize)!=YSOK)
+	{
+		goto ERREND;
+	}
+	return YSOK;
+
+ERREND:
+	if(windowBuf!=NULL)
+	{
+		FlushWindow(windowBuf,windowFlushed,windowUsed,windowSize);
+	}
+	state=STATE_ERROR;
+	return YSERR;
+}
+
+int YsPngUncompressor::InflateHuffman(YSBOOL lastData)
+{
+	// Local copies, so that the compiler can keep them in registers.
+	YsPngBitReader reader=this->reader;
+	unsigned char *const windowBuf=this->windowBuf;
+	const unsigned windowSize=this->windowSize;
+	unsigned windowUsed=this->windowUsed,windowFlushed=this->windowFlushed;
+	unsigned nByteExtracted=this->nByteExtracted;
+	int res=YSOK;
+
+	for(;;)
+	{
+		unsigned e,value;
+		if(YSTRUE!=lastData && reader.length<reader.GetBytePtr()+maxSymbolLength)
 		{
-			printf("Unknown compression type (bType=3)\n");
-			goto ERREND;
+			break;  // Wait for the next piece.
 		}
 
+		reader.Refill();  // Enough for a length code, a distance code, and their extra bits.
+		e=codeTable.Lookup(reader.Peek(YsPngHuffmanTable::maxCodeLength));
+		reader.Consume(YsPngHuffmanTable::GetCodeLength(e));
+		value=YsPngHuffmanTable::GetValue(e);
 
-		if(bFinal!=0)
+		if(YsPngHuffmanTable::SYMBOL==YsPngHuffmanTable::GetKind(e))
 		{
-			break;
+			// printf("[%d]\n",value);
+			if(value<256)
+			{
+				windowBuf[windowUsed++]=(unsigned char)value;
+				if(windowSize<=windowUsed && FlushWindow(windowBuf,windowFlushed,windowUsed,windowSize)!=YSOK)
+				{
+					res=YSERR;
+					break;
+				}
+				nByteExtracted++;
+			}
+			else // 256: End of the block
+			{
+				state=(bFinal!=0 ? STATE_END : STATE_BLOCKHEADER);
+				break;
+			}
 		}
-	}
+		else if(YsPngHuffmanTable::BASE==YsPngHuffmanTable::GetKind(e))
+		{
+			unsigned copyLength,backDist;
+			copyLength=value+reader.Peek(YsPngHuffmanTable::GetExtraBits(e));
+			reader.Consume(YsPngHuffmanTable::GetExtraBits(e));
+			// printf("CopyLength %d\n",copyLength);
 
-	delete [] windowBuf;
-	windowBuf=NULL;
+			e=distTable.Lookup(reader.Peek(YsPngHuffmanTable::maxCodeLength));
+			if(YsPngHuffmanTable::BASE!=YsPngHuffmanTable::GetKind(e))
+			{
+				printf("Huffman Decompression: Invalid distance code.\n");
+				res=YSERR;
+				break;
+			}
+			reader.Consume(YsPngHuffmanTable::GetCodeLength(e));
+			backDist=YsPngHuffmanTable::GetValue(e)+reader.Peek(YsPngHuffmanTable::GetExtraBits(e));
+			reader.Consume(YsPngHuffmanTable::GetExtraBits(e));
+			// printf("BackDist %d\n",backDist);
+			if(windowSize<backDist)
+			{
+				printf("Huffman Decompression: Distance too far back.\n");
+				res=YSERR;
+				break;
+			}
 
+			unsigned i,from;
+			from=(windowUsed-backDist)&(windowSize-1);
+			if(windowUsed+copyLength<windowSize && from+copyLength<=windowSize)
+			{
+				// Neither end wraps around.  Overlapping copy repeats the last backDist bytes.
+				// The source may also be ahead of the destination if backDist is close to the window size.
+				unsigned char *dst=windowBuf+windowUsed;
+				const unsigned char *src=windowBuf+from;
+				if(from+copyLength<=windowUsed || windowUsed+copyLength<=from)
+				{
+					memcpy(dst,src,copyLength);
+				}
+				else
+				{
+					for(i=0; i<copyLength; i++)
+					{
+						dst[i]=src[i];
+					}
+				}
+				windowUsed+=copyLength;
+			}
+			else
+			{
+				for(i=0; i<copyLength && YSOK==res; i++)
+				{
+					windowBuf[windowUsed++]=windowBuf[from];
+					from=(from+1)&(windowSize-1);
+					if(windowSize<=windowUsed && FlushWindow(windowBuf,windowFlushed,windowUsed,windowSize)!=YSOK)
+					{
+						res=YSERR;
+					}
+				}
+				if(YSOK!=res)
+				{
+					break;
+				}
+			}
+			nByteExtracted+=copyLength;
+		}
+		else
+		{
+			printf("Huffman Decompression: Invalid code.\n");
+			res=YSERR;
+			break;
+		}
+
+		if(reader.length<=reader.GetBytePtr())
+		{
+			res=YSERR;
+			break;
+		}
+	}
 
+	this->reader=reader;
+	this->windowUsed=windowUsed;
+	this->windowFlushed=windowFlushed;
+	this->nByteExtracted=nByteExtracted;
+	return res;
+}
 
+int YsPngUncompressor::Uncompress(unsigned length,unsigned char dat[])
+{
 	if(YsGenericPngDecoder::verboseMode==YSTRUE)
 	{
-		printf("End zLib block length=%d bytePtr=%d bitPtr=0x%02x\n",length,bytePtr,bitPtr);
-		printf("Huffman Tree Leak Tracker = %d\n",YsPngHuffmanTree::leakTracker);
-		printf("Output %d bytes.\n",nByteExtracted);
+		printf("Begin zLib block length=%d\n",length);
 	}
 
-	return YSOK;
+	BeginUncompress();
+	reader=YsPngBitReader(length,dat);
+	return EndUncompress();
+}
 
-ERREND:
+void YsPngUncompressor::BeginUncompress(void)
+{
 	if(windowBuf!=NULL)
 	{
 		delete [] windowBuf;
+		windowBuf=NULL;
 	}
-	if(codeTree!=NULL)
+	state=STATE_ZLIBHEADER;
+	bFinal=0;
+	bType=0;
+	storedLength=0;
+	windowSize=0;
+	windowUsed=0;
+	windowFlushed=0;
+	nByteExtracted=0;
+	inBufUsed=0;
+	reader=YsPngBitReader(0,inBuf);
+}
+
+int YsPngUncompressor::PushCompressed(const unsigned char dat[],size_t length)
+{
+	if(STATE_ERROR==state)
 	{
-		DeleteHuffmanTree(codeTree);
+		return YSERR;
 	}
-	if(distTree!=NULL)
+	if(NULL==inBuf)
 	{
-		DeleteHuffmanTree(distTree);
+		inBuf=new unsigned char [inBufSize];
 	}
-	return YSERR;
+
+	while(0<length && STATE_END!=state)
+	{
+		// Drop the bytes consumed, but keep the byte that includes the next bit.
+		// The reader is set up again, because it may have read zeros beyond the end of the data given so far.
+		unsigned int bytePtr=reader.GetBytePtr();
+		const unsigned int bitPtr=(8-(reader.nBitBuf&7))&7;
+		if(inBufUsed<bytePtr)
+		{
+			bytePtr=inBufUsed;
+		}
+		memmove(inBuf,inBuf+bytePtr,inBufUsed-bytePtr);
+		inBufUsed-=bytePtr;
+
+		size_t nCopy=inBufSize-inBufUsed;
+		if(length<nCopy)
+		{
+			nCopy=length;
+		}
+		memcpy(inBuf+inBufUsed,dat,nCopy);
+		inBufUsed+=(unsigned int)nCopy;
+		dat+=nCopy;
+		length-=nCopy;
+
+		reader=YsPngBitReader(inBufUsed,inBuf);
+		if(0<bitPtr)
+		{
+			reader.Refill();
+			reader.Consume(bitPtr);
+		}
+
+		if(Inflate(YSFALSE)!=YSOK)
+		{
+			return YSERR;
+		}
+	}
+	return YSOK;
+}
+
+int YsPngUncompressor::EndUncompress(void)
+{
+	int res=Inflate(YSTRUE);
+
+	if(YSOK==res && YsGenericPngDecoder::verboseMode==YSTRUE)
+	{
+		printf("End zLib block length=%d bytePtr=%d\n",reader.length,reader.GetBytePtr());
+		printf("Output %d bytes.\n",nByteExtracted);
+	}
+
+	if(windowBuf!=NULL)
+	{
+		delete [] windowBuf;
+		windowBuf=NULL;
+	}
+	if(inBuf!=NULL)
+	{
+		delete [] inBuf;
+		inBuf=NULL;
+	}
+	reader=YsPngBitReader();
+	return res;
 }
 
 ////////////////////////////////////////////////////////////
@@ -1011,104 +1318,265 @@ int YsGenericPngDecoder::Decode(FILE *fp)
 
 int YsGenericPngDecoder::Decode(YsPngGenericBinaryStream &binStream)
 {
-	const size_t fileSize=binStream.GetSize();
+	// The file is given in pieces, and is not in memory at once.
+	unsigned char *readBuf=new unsigned char [readBufSize];
+	size_t nRead;
+	int res=YSOK;
 
-	if(CheckSignature(binStream)!=YSOK)
+	BeginIncrementalDecode();
+	while(YSOK==res && STREAM_END!=streamState && 0<(nRead=binStream.Read(readBuf,readBufSize)))
 	{
-		printf("The file does not have PNG signature.\n");
-		return YSERR;
+		res=PushData(readBuf,nRead);
+	}
+	if(EndIncrementalDecode()!=YSOK)
+	{
+		res=YSERR;
 	}
 
-	unsigned datBufUsed;
-	unsigned char *datBuf;
-
-
-	datBufUsed=0;
-	datBuf=new unsigned char [fileSize];
+	delete [] readBuf;
+	return res;
+}
 
+void YsGenericPngDecoder::BeginIncrementalDecode(void)
+{
+	if(chunkBuf!=NULL)
+	{
+		delete [] chunkBuf;
+		chunkBuf=NULL;
+	}
+	streamState=STREAM_SIGNATURE;
+	imageDataState=IMAGEDATA_NONE;
+	streamBufUsed=0;
+	chunkType=0;
+	chunkLength=0;
+	chunkUsed=0;
+}
 
-	unsigned char *buf;
-	unsigned length,chunkType,crc;
-	while(ReadChunk(length,buf,chunkType,crc,binStream)==YSOK && chunkType!=IEND)
+int YsGenericPngDecoder::PushData(const unsigned char dat[],size_t n)
+{
+	while(0<n)
 	{
-		switch(chunkType)
+		if(STREAM_CHUNKDATA==streamState)
 		{
-		default:
-			if(buf!=NULL)
+			size_t nData=chunkLength-chunkUsed;
+			if(n<nData)
 			{
-				delete [] buf;
+				nData=n;
 			}
-			break;
-		case IHDR:
-			if(buf!=NULL)
+			if(ChunkData(dat,nData)!=YSOK)
 			{
-				if(length>=13)
-				{
-					hdr.Decode(buf);
-				}
-				delete [] buf;
+				streamState=STREAM_ERROR;
+				return YSERR;
 			}
-			break;
-		case PLTE:
-			if(buf!=NULL)
+			chunkUsed+=(unsigned int)nData;
+			dat+=nData;
+			n-=nData;
+
+			if(chunkLength==chunkUsed)
 			{
-				if(plt.Decode(length,buf)!=YSOK)
+				if(EndChunk()!=YSOK)
 				{
-					delete [] buf;
+					streamState=STREAM_ERROR;
 					return YSERR;
 				}
-				delete [] buf;
+				streamState=STREAM_CHUNKCRC;
 			}
-			break;
-		case tRNS:
-			if(buf!=NULL)
+		}
+		else if(STREAM_SIGNATURE==streamState || STREAM_CHUNKHEADER==streamState || STREAM_CHUNKCRC==streamState)
+		{
+			const unsigned int streamBufLength=(STREAM_CHUNKCRC==streamState ? 4 : 8);
+			size_t nCopy=streamBufLength-streamBufUsed;
+			if(n<nCopy)
 			{
-				trns.Decode(length,buf,hdr.colorType);
-				delete [] buf;
+				nCopy=n;
 			}
-			break;
-		case gAMA:
-			if(buf!=NULL && length>=4)
+			memcpy(streamBuf+streamBufUsed,dat,nCopy);
+			streamBufUsed+=(unsigned int)nCopy;
+			dat+=nCopy;
+			n-=nCopy;
+
+			if(streamBufLength==streamBufUsed)
 			{
-				gamma=PngGetUnsignedInt(buf);
-				if(YsGenericPngDecoder::verboseMode==YSTRUE)
+				streamBufUsed=0;
+				if(STREAM_SIGNATURE==streamState)
 				{
-					printf("Gamma %d (default=%d)\n",gamma,gamma_default);
+					if(0!=memcmp(streamBuf,YsPngSignature,8))
+					{
+						printf("The file does not have PNG signature.\n");
+						streamState=STREAM_ERROR;
+						return YSERR;
+					}
+					streamState=STREAM_CHUNKHEADER;
 				}
-				delete [] buf;
-			}
-			break;
-		case IDAT:
-			if(buf!=NULL)
-			{
-				unsigned i;
-				for(i=0; i<length; i++)
+				else if(STREAM_CHUNKHEADER==streamState)
 				{
-					datBuf[datBufUsed+i]=buf[i];
+					if(BeginChunk(PngGetUnsignedInt(streamBuf),PngGetUnsignedInt(streamBuf+4))!=YSOK)
+					{
+						streamState=STREAM_ERROR;
+						return YSERR;
+					}
+				}
+				else // CRC is not checked.
+				{
+					streamState=(IEND==chunkType ? STREAM_END : STREAM_CHUNKHEADER);
 				}
-				datBufUsed+=length;
-				delete [] buf;
 			}
-			break;
 		}
+		else if(STREAM_END==streamState)
+		{
+			break;  // Bytes after IEND are ignored.
+		}
+		else
+		{
+			return YSERR;
+		}
+	}
+	return YSOK;
+}
+
+int YsGenericPngDecoder::EndIncrementalDecode(void)
+{
+	int res=(STREAM_ERROR!=streamState ? YSOK : YSERR);
+
+	// The file may end without IEND.  The image data received so far is still given to the output.
+	if(IMAGEDATA_STARTED==imageDataState && EndImageData()!=YSOK)
+	{
+		res=YSERR;
+	}
+	else if(IMAGEDATA_NONE==imageDataState)
+	{
+		res=YSERR;
 	}
 
+	if(chunkBuf!=NULL)
+	{
+		delete [] chunkBuf;
+		chunkBuf=NULL;
+	}
+	return res;
+}
 
+int YsGenericPngDecoder::BeginChunk(unsigned int length,unsigned int type)
+{
+	chunkLength=length;
+	chunkType=type;
+	chunkUsed=0;
 
-	if(PrepareOutput()==YSOK)
+	if(YsGenericPngDecoder::verboseMode==YSTRUE)
 	{
-		YsPngUncompressor uncompressor;
-		uncompressor.output=this;
-		uncompressor.Uncompress(datBufUsed,datBuf);
+		printf("Chunk name=%c%c%c%c\n",streamBuf[4],streamBuf[5],streamBuf[6],streamBuf[7]);
+	}
 
-		EndOutput();
+	if(IDAT==chunkType)
+	{
+		if(BeginImageData()!=YSOK)
+		{
+			return YSERR;
+		}
+	}
+	else
+	{
+		// A chunk after IDAT chunks ends the image data.
+		if(IMAGEDATA_STARTED==imageDataState && EndImageData()!=YSOK)
+		{
+			return YSERR;
+		}
+		if((IHDR==chunkType || PLTE==chunkType || tRNS==chunkType || gAMA==chunkType) &&
+		   0<chunkLength && chunkLength<=maxBufferedChunkLength)
+		{
+			chunkBuf=new unsigned char [chunkLength];
+		}
 	}
 
+	streamState=STREAM_CHUNKDATA;
+	if(0==chunkLength)
+	{
+		if(EndChunk()!=YSOK)
+		{
+			return YSERR;
+		}
+		streamState=STREAM_CHUNKCRC;
+	}
+	return YSOK;
+}
 
-	delete [] datBuf;
+int YsGenericPngDecoder::ChunkData(const unsigned char dat[],size_t n)
+{
+	if(IDAT==chunkType)
+	{
+		if(IMAGEDATA_STARTED==imageDataState)
+		{
+			return uncompressor.PushCompressed(dat,n);
+		}
+	}
+	else if(chunkBuf!=NULL)
+	{
+		memcpy(chunkBuf+chunkUsed,dat,n);
+	}
 	return YSOK;
 }
 
+int YsGenericPngDecoder::EndChunk(void)
+{
+	int res=YSOK;
+	if(chunkBuf!=NULL)
+	{
+		switch(chunkType)
+		{
+		case IHDR:
+			if(chunkLength>=13)
+			{
+				hdr.Decode(chunkBuf);
+			}
+			break;
+		case PLTE:
+			res=plt.Decode(chunkLength,chunkBuf);
+			break;
+		case tRNS:
+			trns.Decode(chunkLength,chunkBuf,hdr.colorType);
+			break;
+		case gAMA:
+			if(chunkLength>=4)
+			{
+				gamma=PngGetUnsignedInt(chunkBuf);
+				if(YsGenericPngDecoder::verboseMode==YSTRUE)
+				{
+					printf("Gamma %d (default=%d)\n",gamma,gamma_default);
+				}
+			}
+			break;
+		}
+		delete [] chunkBuf;
+		chunkBuf=NULL;
+	}
+	return res;
+}
+
+int YsGenericPngDecoder::BeginImageData(void)
+{
+	if(IMAGEDATA_NONE==imageDataState)
+	{
+		if(PrepareOutput()!=YSOK)
+		{
+			return YSERR;
+		}
+		uncompressor.BeginUncompress();
+		imageDataState=IMAGEDATA_STARTED;
+	}
+	return YSOK;
+}
+
+int YsGenericPngDecoder::EndImageData(void)
+{
+	int res=uncompressor.EndUncompress();
+	if(EndOutput()!=YSOK)
+	{
+		res=YSERR;
+	}
+	imageDataState=IMAGEDATA_FINISHED;
+	return res;
+}
+
 int YsGenericPngDecoder::PrepareOutput(void)
 {
 	return YSOK;
@@ -1119,6 +1587,19 @@ int YsGenericPngDecoder::Output(unsigned char)
 	return YSOK;
 }
 
+int YsGenericPngDecoder::OutputSpan(const unsigned char dat[],size_t n)
+{
+	size_t i;
+	for(i=0; i<n; i++)
+	{
+		if(Output(dat[i])!=YSOK)
+		{
+			return YSERR;
+		}
+	}
+	return YSOK;
+}
+
 int YsGenericPngDecoder::EndOutput(void)
 {
 	return YSOK;
@@ -1155,49 +1636,366 @@ static inline unsigned char Paeth(unsigned int ua,unsigned int ub,unsigned int u
 	}
 }
 
-static inline void Filter8(unsigned char curLine[],unsigned char prvLine[],int x,int y,int unitLng,int filter)
+// Reverses the filter of a line.  See PNG Specification 9 Filtering.
+// unitLng is the bytes per pixel, or 1 if a pixel is less than 8 bits.
+// prvLine must be all zero for the first line of an image or an interlace pass.
+// This is the reference of the SIMD versions below.
+static void UnfilterLineScalar(unsigned char curLine[],const unsigned char prvLine[],unsigned int lineLng,unsigned int unitLng,int filter)
 {
-	int i;
+	unsigned int i;
 	switch(filter)
 	{
 	case 1:
-		if(x>0)
+		for(i=unitLng; i<lineLng; i++)
 		{
-			for(i=0; i<unitLng; i++)
-			{
-				curLine[x*unitLng+i]+=curLine[x*unitLng+i-unitLng];
-			}
+			curLine[i]+=curLine[i-unitLng];
 		}
 		break;
 	case 2:
-		if(y>0)
+		for(i=0; i<lineLng; i++)
 		{
-			for(i=0; i<unitLng; i++)
-			{
-				curLine[x*unitLng+i]+=prvLine[x*unitLng+i];
-			}
+			curLine[i]+=prvLine[i];
 		}
 		break;
 	case 3:
-		for(i=0; i<unitLng; i++)
+		for(i=0; i<unitLng && i<lineLng; i++)
 		{
-			unsigned int a;
-			a=(x>0 ? curLine[x*unitLng+i-unitLng] : 0);
-			a+=(y>0 ? prvLine[x*unitLng+i] : 0);
-			curLine[x*unitLng+i]+=(unsigned char)(a/2);
+			curLine[i]+=(unsigned char)(prvLine[i]/2);
+		}
+		for(i=unitLng; i<lineLng; i++)
+		{
+			curLine[i]+=(unsigned char)(((unsigned int)curLine[i-unitLng]+(unsigned int)prvLine[i])/2);
 		}
 		break;
 	case 4:
-		for(i=0; i<unitLng; i++)
+		for(i=0; i<unitLng && i<lineLng; i++)
+		{
+			curLine[i]+=prvLine[i];  // Paeth(0,b,0) is b.
+		}
+		for(i=unitLng; i<lineLng; i++)
+		{
+			curLine[i]+=Paeth(curLine[i-unitLng],prvLine[i],prvLine[i-unitLng]);
+		}
+		break;
+	}
+}
+
+#ifdef YSPNG_X86_SIMD
+
+// SIMD versions of UnfilterLine for 3- and 4-byte pixels.
+// Sub, Average, and Paeth depend on the pixel on the left, therefore a pixel is processed at a time,
+// but all channels of the pixel at once.  Up has no such dependency and takes 16 or 32 bytes at a time.
+
+static inline __m128i LoadPixel(const unsigned char dat[],unsigned int unitLng)
+{
+	int value=0;
+	memcpy(&value,dat,unitLng);
+	return _mm_cvtsi32_si128(value);
+}
+
+static inline void StorePixel(unsigned char dat[],__m128i pix,unsigned int unitLng)
+{
+	int value=_mm_cvtsi128_si32(pix);
+	memcpy(dat,&value,unitLng);
+}
+
+static inline void UnfilterSubSSE2(unsigned char curLine[],unsigned int lineLng,unsigned int unitLng)
+{
+	unsigned int i;
+	__m128i a=_mm_setzero_si128();
+	for(i=0; i+unitLng<=lineLng; i+=unitLng)
+	{
+		a=_mm_add_epi8(a,LoadPixel(curLine+i,unitLng));
+		StorePixel(curLine+i,a,unitLng);
+	}
+}
+
+static inline void UnfilterAverageSSE2(unsigned char curLine[],const unsigned char prvLine[],unsigned int lineLng,unsigned int unitLng)
+{
+	unsigned int i;
+	const __m128i one=_mm_set1_epi8(1);
+	__m128i a=_mm_setzero_si128();
+	for(i=0; i+unitLng<=lineLng; i+=unitLng)
+	{
+		// _mm_avg_epu8 rounds up.  Subtract the carry for rounding down.
+		const __m128i b=LoadPixel(prvLine+i,unitLng);
+		__m128i avg=_mm_avg_epu8(a,b);
+		avg=_mm_sub_epi8(avg,_mm_and_si128(_mm_xor_si128(a,b),one));
+		a=_mm_add_epi8(LoadPixel(curLine+i,unitLng),avg);
+		StorePixel(curLine+i,a,unitLng);
+	}
+}
+
+static inline __m128i Abs16SSE2(__m128i x)
+{
+	return _mm_max_epi16(x,_mm_sub_epi16(_mm_setzero_si128(),x));
+}
+
+static inline __m128i Select(__m128i cond,__m128i ifTrue,__m128i ifFalse)
+{
+	return _mm_or_si128(_mm_and_si128(cond,ifTrue),_mm_andnot_si128(cond,ifFalse));
+}
+
+// Paeth predictor of all channels of a pixel in 16-bit lanes.  p=a+b-c, therefore p-a=b-c, p-b=a-c, and p-c=(a-c)+(b-c).
+// Ties are broken in the order of a, b, and c as Paeth() does.
+static inline __m128i PaethPredictor(__m128i a,__m128i b,__m128i c,__m128i pa,__m128i pb,__m128i pc)
+{
+	const __m128i smallest=_mm_min_epi16(pc,_mm_min_epi16(pa,pb));
+	return Select(_mm_cmpeq_epi16(smallest,pa),a,Select(_mm_cmpeq_epi16(smallest,pb),b,c));
+}
+
+static inline void UnfilterPaethSSE2(unsigned char curLine[],const unsigned char prvLine[],unsigned int lineLng,unsigned int unitLng)
+{
+	unsigned int i;
+	const __m128i zero=_mm_setzero_si128();
+	__m128i a=zero,c=zero;
+	for(i=0; i+unitLng<=lineLng; i+=unitLng)
+	{
+		const __m128i b=_mm_unpacklo_epi8(LoadPixel(prvLine+i,unitLng),zero);
+		const __m128i pa=_mm_sub_epi16(b,c),pb=_mm_sub_epi16(a,c),pc=_mm_add_epi16(pa,pb);
+		const __m128i p=PaethPredictor(a,b,c,Abs16SSE2(pa),Abs16SSE2(pb),Abs16SSE2(pc));
+		const __m128i d=_mm_add_epi8(LoadPixel(curLine+i,unitLng),_mm_packus_epi16(p,p));
+		StorePixel(curLine+i,d,unitLng);
+		a=_mm_unpacklo_epi8(d,zero);
+		c=b;
+	}
+}
+
+__attribute__((target("ssse3")))
+static inline void UnfilterPaethSSSE3(unsigned char curLine[],const unsigned char prvLine[],unsigned int lineLng,unsigned int unitLng)
+{
+	unsigned int i;
+	const __m128i zero=_mm_setzero_si128();
+	__m128i a=zero,c=zero;
+	for(i=0; i+unitLng<=lineLng; i+=unitLng)
+	{
+		const __m128i b=_mm_unpacklo_epi8(LoadPixel(prvLine+i,unitLng),zero);
+		const __m128i pa=_mm_sub_epi16(b,c),pb=_mm_sub_epi16(a,c),pc=_mm_add_epi16(pa,pb);
+		const __m128i p=PaethPredictor(a,b,c,_mm_abs_epi16(pa),_mm_abs_epi16(pb),_mm_abs_epi16(pc));
+		const __m128i d=_mm_add_epi8(LoadPixel(curLine+i,unitLng),_mm_packus_epi16(p,p));
+		StorePixel(curLine+i,d,unitLng);
+		a=_mm_unpacklo_epi8(d,zero);
+		c=b;
+	}
+}
+
+static void UnfilterUpSSE2(unsigned char curLine[],const unsigned char prvLine[],unsigned int lineLng)
+{
+	unsigned int i;
+	for(i=0; i+16<=lineLng; i+=16)
+	{
+		const __m128i cur=_mm_loadu_si128((const __m128i *)(curLine+i));
+		const __m128i prv=_mm_loadu_si128((const __m128i *)(prvLine+i));
+		_mm_storeu_si128((__m128i *)(curLine+i),_mm_add_epi8(cur,prv));
+	}
+	for(; i<lineLng; i++)
+	{
+		curLine[i]+=prvLine[i];
+	}
+}
+
+__attribute__((target("avx2")))
+static void UnfilterUpAVX2(unsigned char curLine[],const unsigned char prvLine[],unsigned int lineLng)
+{
+	unsigned int i;
+	for(i=0; i+32<=lineLng; i+=32)
+	{
+		const __m256i cur=_mm256_loadu_si256((const __m256i *)(curLine+i));
+		const __m256i prv=_mm256_loadu_si256((const __m256i *)(prvLine+i));
+		_mm256_storeu_si256((__m256i *)(curLine+i),_mm256_add_epi8(cur,prv));
+	}
+	for(; i<lineLng; i++)
+	{
+		curLine[i]+=prvLine[i];
+	}
+}
+
+static void UnfilterSub3SSE2(unsigned char curLine[],const unsigned char [],unsigned int lineLng)
+{
+	UnfilterSubSSE2(curLine,lineLng,3);
+}
+static void UnfilterSub4SSE2(unsigned char curLine[],const unsigned char [],unsigned int lineLng)
+{
+	UnfilterSubSSE2(curLine,lineLng,4);
+}
+static void UnfilterAverage3SSE2(unsigned char curLine[],const unsigned char prvLine[],unsigned int lineLng)
+{
+	UnfilterAverageSSE2(curLine,prvLine,lineLng,3);
+}
+static void UnfilterAverage4SSE2(unsigned char curLine[],const unsigned char prvLine[],unsigned int lineLng)
+{
+	UnfilterAverageSSE2(curLine,prvLine,lineLng,4);
+}
+static void UnfilterPaeth3SSE2(unsigned char curLine[],const unsigned char prvLine[],unsigned int lineLng)
+{
+	UnfilterPaethSSE2(curLine,prvLine,lineLng,3);
+}
+static void UnfilterPaeth4SSE2(unsigned char curLine[],const unsigned char prvLine[],unsigned int lineLng)
+{
+	UnfilterPaethSSE2(curLine,prvLine,lineLng,4);
+}
+__attribute__((target("ssse3")))
+static void UnfilterPaeth3SSSE3(unsigned char curLine[],const unsigned char prvLine[],unsigned int lineLng)
+{
+	UnfilterPaethSSSE3(curLine,prvLine,lineLng,3);
+}
+__attribute__((target("ssse3")))
+static void UnfilterPaeth4SSSE3(unsigned char curLine[],const unsigned char prvLine[],unsigned int lineLng)
+{
+	UnfilterPaethSSSE3(curLine,prvLine,lineLng,4);
+}
+
+#endif // YSPNG_X86_SIMD
+
+// Unfilter functions of a SIMD level.  NULL means UnfilterLineScalar.
+// [0] for 3-byte pixels, [1] for 4-byte pixels.  Up is the same for any pixel size.
+typedef void (*YsPngUnfilterFunction)(unsigned char curLine[],const unsigned char prvLine[],unsigned int lineLng);
+class YsPngUnfilterSet
+{
+public:
+	enum
+	{
+		SCALAR=0,
+		SSE2=1,
+		SSSE3=2,
+		AVX2=3
+	};
+	YsPngUnfilterFunction sub[2],up,average[2],paeth[2];
+
+	explicit YsPngUnfilterSet(int level);
+	static int GetMaxLevel(void);
+	static const YsPngUnfilterSet &Get(void);
+};
+
+YsPngUnfilterSet::YsPngUnfilterSet(int level)
+{
+	sub[0]=NULL;
+	sub[1]=NULL;
+	up=NULL;
+	average[0]=NULL;
+	average[1]=NULL;
+	paeth[0]=NULL;
+	paeth[1]=NULL;
+#ifdef YSPNG_X86_SIMD
+	if(SSE2<=level)
+	{
+		sub[0]=UnfilterSub3SSE2;
+		sub[1]=UnfilterSub4SSE2;
+		up=UnfilterUpSSE2;
+		average[0]=UnfilterAverage3SSE2;
+		average[1]=UnfilterAverage4SSE2;
+		paeth[0]=UnfilterPaeth3SSE2;
+		paeth[1]=UnfilterPaeth4SSE2;
+	}
+	if(SSSE3<=level)
+	{
+		paeth[0]=UnfilterPaeth3SSSE3;
+		paeth[1]=UnfilterPaeth4SSSE3;
+	}
+	if(AVX2<=level)
+	{
+		up=UnfilterUpAVX2;
+	}
+#else
+	(void)level;
+#endif
+}
+
+int YsPngUnfilterSet::GetMaxLevel(void)
+{
+#ifdef YSPNG_X86_SIMD
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2"))
+	{
+		return AVX2;
+	}
+	if(__builtin_cpu_supports("ssse3"))
+	{
+		return SSSE3;
+	}
+	return SSE2;  // Always available on x86-64
+#else
+	return SCALAR;
+#endif
+}
+
+const YsPngUnfilterSet &YsPngUnfilterSet::Get(void)
+{
+	static const YsPngUnfilterSet set(GetMaxLevel());
+	return set;
+}
+
+static void UnfilterLine(const YsPngUnfilterSet &set,unsigned char curLine[],const unsigned char prvLine[],unsigned int lineLng,unsigned int unitLng,int filter)
+{
+	YsPngUnfilterFunction func=NULL;
+	if(2==filter)
+	{
+		func=set.up;
+	}
+	else if(3==unitLng || 4==unitLng)
+	{
+		switch(filter)
+		{
+		case 1:
+			func=set.sub[unitLng-3];
+			break;
+		case 3:
+			func=set.average[unitLng-3];
+			break;
+		case 4:
+			func=set.paeth[unitLng-3];
+			break;
+		}
+	}
+
+	if(NULL!=func)
+	{
+		(*func)(curLine,prvLine,lineLng);
+	}
+	else
+	{
+		UnfilterLineScalar(curLine,prvLine,lineLng,unitLng,filter);
+	}
+}
+
+int YsPngCheckUnfilter(void)
+{
+	const int maxLevel=YsPngUnfilterSet::GetMaxLevel();
+	const unsigned int maxLineLng=4*67;
+	unsigned char prvLine[maxLineLng],src[maxLineLng],ref[maxLineLng],simd[maxLineLng];
+	unsigned int seed=12345,i,unitLng,lineLng;
+	int level,filter,res=YSOK;
+
+	for(level=YsPngUnfilterSet::SSE2; level<=maxLevel; level++)
+	{
+		const YsPngUnfilterSet set(level);
+		for(unitLng=3; unitLng<=4; unitLng++)
 		{
-			unsigned int a,b,c;
-			a=(x>0 ? curLine[x*unitLng+i-unitLng] : 0);
-			b=(y>0 ? prvLine[x*unitLng+i] : 0);
-			c=((x>0 && y>0) ? prvLine[x*unitLng-unitLng+i] : 0);
-			curLine[x*unitLng+i]+=Paeth(a,b,c);
+			for(lineLng=0; lineLng<=maxLineLng; lineLng+=unitLng)
+			{
+				for(filter=0; filter<=4; filter++)
+				{
+					for(i=0; i<lineLng; i++)
+					{
+						seed=seed*1103515245+12345;
+						src[i]=(unsigned char)(seed>>16);
+						seed=seed*1103515245+12345;
+						prvLine[i]=(unsigned char)(seed>>16);
+					}
+					memcpy(ref,src,lineLng);
+					memcpy(simd,src,lineLng);
+					UnfilterLineScalar(ref,prvLine,lineLng,unitLng,filter);
+					UnfilterLine(set,simd,prvLine,lineLng,unitLng,filter);
+					if(0!=memcmp(ref,simd,lineLng))
+					{
+						printf("Unfilter mismatch: SIMD level %d, %d bytes per pixel, filter %d, %d bytes\n",level,unitLng,filter,lineLng);
+						res=YSERR;
+					}
+				}
+			}
 		}
-		break;
 	}
+	return res;
 }
 
 YsRawPngDecoder::YsRawPngDecoder()
@@ -1316,14 +2114,6 @@ int YsRawPngDecoder::PrepareOutput(void)
 		rgba=NULL;
 	}
 	rgba=new unsigned char [wid*hei*4];
-	x=-1;
-	y=0;
-	filter=0;
-	inLineCount=0;
-	inPixelCount=0;
-	firstByte=1;
-	index=0;
-	interlacePass=1;
 
 	if(twoLineBuf8!=NULL)
 	{
@@ -1415,604 +2205,311 @@ int YsRawPngDecoder::PrepareOutput(void)
 	curLine8=twoLineBuf8;
 	prvLine8=twoLineBuf8+twoLineBufLngPerLine;
 
+	switch(hdr.colorType)
+	{
+	default:
+	case 0:   // Greyscale
+	case 3:   // Indexed-color
+		bitPerPixel=hdr.bitDepth;
+		break;
+	case 2:   // Truecolor
+		bitPerPixel=hdr.bitDepth*3;
+		break;
+	case 4:   // Greyscale with alpha
+		bitPerPixel=hdr.bitDepth*2;
+		break;
+	case 6:   // Truecolor with alpha
+		bitPerPixel=hdr.bitDepth*4;
+		break;
+	}
+
+	switch(hdr.interlaceMethod)
+	{
+	case 0:
+		interlacePass=0;
+		break;
+	case 1:
+		interlacePass=1;
+		break;
+	default:
+		printf("Unsupported interlace method.\n");
+		return YSERR;
+	}
+	filter=0;
+	StartInterlacePass();
+
 	return YSOK;
 }
 
-int YsRawPngDecoder::Output(unsigned char dat)
+//   1 6 4 6 2 6 4 6
+//   7 7 7 7 7 7 7 7
+//   5 6 5 6 5 6 5 6
+//   7 7 7 7 7 7 7 7
+//   3 6 4 6 3 6 4 6
+//   7 7 7 7 7 7 7 7
+//   5 6 5 6 5 6 5 6
+//   7 7 7 7 7 7 7 7
+// Pass 0 is the whole image of a non-interlaced PNG.
+static const int YsPngInterlaceX0[8]={0,0,4,0,2,0,1,0};
+static const int YsPngInterlaceY0[8]={0,0,0,4,0,2,0,1};
+static const int YsPngInterlaceDx[8]={1,8,8,4,4,2,2,1};
+static const int YsPngInterlaceDy[8]={1,8,8,8,4,4,2,2};
+
+void YsRawPngDecoder::StartInterlacePass(void)
 {
-	unsigned int i;
-	unsigned int colIdx;
-	unsigned int interlaceWid,interlaceHei,interlaceX,interlaceY;
+	// A pass without a pixel has no line in the data, and is skipped.
+	while(interlacePass<8)
+	{
+		passX0=YsPngInterlaceX0[interlacePass];
+		passY0=YsPngInterlaceY0[interlacePass];
+		passDx=YsPngInterlaceDx[interlacePass];
+		passDy=YsPngInterlaceDy[interlacePass];
+		passWid=(passX0<wid ? (wid-passX0+passDx-1)/passDx : 0);
+		passHei=(passY0<hei ? (hei-passY0+passDy-1)/passDy : 0);
+		if(0<passWid && 0<passHei)
+		{
+			break;
+		}
+		interlacePass=(0==interlacePass ? 8 : interlacePass+1);
+	}
 
-	if(y>=hei)
+	if(YsGenericPngDecoder::verboseMode==YSTRUE)
 	{
-		return YSERR;
+		printf("Interlace Pass %d\n",interlacePass);
 	}
 
-	if(x==-1)  // First byte is filter type for the line.  
+	y=0;
+	lineUsed=0;
+	if(interlacePass<8)
 	{
-		filter=dat;   // See PNG Specification 4.5.4 Filtering, 9 Filtering
-		inLineCount=0;
-		inPixelCount=0;
-		x++;
-		// printf("y=%d filter=%d\n",y,filter);
-		return YSOK;
+		lineLng=(passWid*bitPerPixel+7)/8;
+		memset(prvLine8,0,lineLng);
+	}
+}
+
+YSBOOL YsRawPngDecoder::IsLastPassOfLine(int lineY) const
+{
+	unsigned int pass;
+	if(0==interlacePass)
+	{
+		return YSTRUE;
 	}
-	else 
+	for(pass=interlacePass+1; pass<8; pass++)
 	{
-		switch(hdr.interlaceMethod)
+		if(YsPngInterlaceX0[pass]<wid && YsPngInterlaceY0[pass]<=lineY &&
+		   0==(lineY-YsPngInterlaceY0[pass])%YsPngInterlaceDy[pass])
 		{
-		// Non-Interlace
-		case 0:
-			switch(hdr.colorType)  // See PNG Specification 6.1 Colour types and values
-			{
-			// Grayscale
-			case 0:
-				switch(hdr.bitDepth)
-				{
-				case 1:
-					curLine8[x/8]=dat;
-					Filter8(curLine8,prvLine8,x/8,y,1,filter);
-
-					for(i=0; i<8 && x<wid; i++)
-					{
-						colIdx=(curLine8[x/8]>>(7-i))&1;
-						colIdx=(colIdx<<1)+colIdx;
-						colIdx=(colIdx<<2)+colIdx;
-						colIdx=(colIdx<<4)+colIdx;
-
-						rgba[index  ]=(unsigned char)colIdx;
-						rgba[index+1]=(unsigned char)colIdx;
-						rgba[index+2]=(unsigned char)colIdx;
-						rgba[index+3]=0;
-						x++;
-						index+=4;
-					}
-					break;
-
-				case 8:
-					curLine8[x]=dat;
-					Filter8(curLine8,prvLine8,x,y,1,filter);
-					colIdx=curLine8[x];
-
-					rgba[index  ]=curLine8[x];
-					rgba[index+1]=curLine8[x];
-					rgba[index+2]=curLine8[x];
-					if(curLine8[x]==trns.col[0] || curLine8[x]==trns.col[1] || curLine8[x]==trns.col[2])
-					{
-						rgba[index+3]=0;
-					}
-					else
-					{
-						rgba[index+3]=255;
-					}
-
-					x++;
-					index+=4;
-					break;
-				}
-				break;
-
-
-
-			// True color
-			case 2:
-				switch(hdr.bitDepth)
-				{
-				case 8:
-					curLine8[inLineCount+inPixelCount]=dat;
-					inPixelCount++;
-					if(inPixelCount==3)
-					{
-						Filter8(curLine8,prvLine8,x,y,3,filter);
-						rgba[index  ]=curLine8[inLineCount];
-						rgba[index+1]=curLine8[inLineCount+1];
-						rgba[index+2]=curLine8[inLineCount+2];
-
-						if(curLine8[inLineCount  ]==trns.col[0] && 
-						   curLine8[inLineCount+1]==trns.col[1] && 
-						   curLine8[inLineCount+2]==trns.col[2])
-						{
-							rgba[index+3]=0;
-						}
-						else
-						{
-							rgba[index+3]=255;
-						}
-
-						x++;
-						index+=4;
-						inLineCount+=3;
-						inPixelCount=0;
-					}
-					break;
-				case 16:
-					curLine8[inLineCount+inPixelCount]=dat;
-					inPixelCount++;
-					if(inPixelCount==6)
-					{
-						Filter8(curLine8,prvLine8,x,y,6,filter);
-						rgba[index  ]=curLine8[inLineCount  ];
-						rgba[index+1]=curLine8[inLineCount+2];
-						rgba[index+2]=curLine8[inLineCount+4];
-
-						r=curLine8[inLineCount  ]*256+curLine8[inLineCount+1];
-						g=curLine8[inLineCount+2]*256+curLine8[inLineCount+3];
-						b=curLine8[inLineCount+4]*256+curLine8[inLineCount+5];
-						if(r==trns.col[0] && g==trns.col[1] && b==trns.col[2])
-						{
-							rgba[index+3]=0;
-						}
-						else
-						{
-							rgba[index+3]=255;
-						}
-						x++;
-						index+=4;
-						inLineCount+=6;
-						inPixelCount=0;
-					}
-					break;
-				}
-				break;
-
-
-
-			// Indexed color
-			case 3:
-				switch(hdr.bitDepth)
-				{
-				case 1:
-					curLine8[x/8]=dat;
-					Filter8(curLine8,prvLine8,x/8,y,1,filter);
-
-					for(i=0; i<8 && x<wid; i++)
-					{
-						colIdx=(curLine8[x/8]>>(7-i))&1;
-						if(colIdx<plt.nEntry)
-						{
-							rgba[index  ]=plt.entry[colIdx*3  ];
-							rgba[index+1]=plt.entry[colIdx*3+1];
-							rgba[index+2]=plt.entry[colIdx*3+2];
-							if(colIdx==trns.col[0] || colIdx==trns.col[1] || colIdx==trns.col[2])
-							{
-								rgba[index+3]=0;
-							}
-							else
-							{
-								rgba[index+3]=255;
-							}
-						}
-						else
-						{
-							printf("Not enough palette entry! (%d)\n",plt.nEntry);
-						}
-						x++;
-						index+=4;
-					}
-					break;
-				case 2:
-					curLine8[x/4]=dat;
-					Filter8(curLine8,prvLine8,x/4,y,1,filter);
-
-					for(i=0; i<4 && x<wid; i++)
-					{
-						colIdx=(curLine8[x/4]>>((3-i)*2))&0x03;
-
-						if(colIdx<plt.nEntry)
-						{
-							rgba[index  ]=plt.entry[colIdx*3  ];
-							rgba[index+1]=plt.entry[colIdx*3+1];
-							rgba[index+2]=plt.entry[colIdx*3+2];
-							if(colIdx==trns.col[0] || colIdx==trns.col[1] || colIdx==trns.col[2])
-							{
-								rgba[index+3]=0;
-							}
-							else
-							{
-								rgba[index+3]=255;
-							}
-						}
-						x++;
-						index+=4;
-					}
-					break;
-
-				case 4:
-					curLine8[x/2]=dat;
-					Filter8(curLine8,prvLine8,x/2,y,1,filter);
-
-					for(i=0; i<2 && x<wid; i++)
-					{
-						colIdx=(curLine8[x/2]>>((1-i)*4))&0x0f;
-
-						if(colIdx<plt.nEntry)
-						{
-							rgba[index  ]=plt.entry[colIdx*3  ];
-							rgba[index+1]=plt.entry[colIdx*3+1];
-							rgba[index+2]=plt.entry[colIdx*3+2];
-							if(colIdx==trns.col[0] || colIdx==trns.col[1] || colIdx==trns.col[2])
-							{
-								rgba[index+3]=0;
-							}
-							else
-							{
-								rgba[index+3]=255;
-							}
-						}
-						x++;
-						index+=4;
-					}
-					break;
-
-				case 8:
-					curLine8[x]=dat;
-					Filter8(curLine8,prvLine8,x,y,1,filter);
-					colIdx=curLine8[x];
-
-					if(colIdx<plt.nEntry)
-					{
-						rgba[index  ]=plt.entry[colIdx*3  ];
-						rgba[index+1]=plt.entry[colIdx*3+1];
-						rgba[index+2]=plt.entry[colIdx*3+2];
-						if(colIdx==trns.col[0] || colIdx==trns.col[1] || colIdx==trns.col[2])
-						{
-							rgba[index+3]=0;
-						}
-						else
-						{
-							rgba[index+3]=255;
-						}
-					}
-					x++;
-					index+=4;
-					break;
-				}
-				break;
-
-
+			return YSFALSE;
+		}
+	}
+	return YSTRUE;
+}
 
-			// Greyscale with alpha
-			case 4:
-				switch(hdr.bitDepth)
-				{
-				case 8:
-					curLine8[inLineCount+inPixelCount]=dat;
-					inPixelCount++;
-					if(inPixelCount==2)
-					{
-						Filter8(curLine8,prvLine8,x,y,2,filter);
-						rgba[index  ]=curLine8[inLineCount  ];
-						rgba[index+1]=curLine8[inLineCount  ];
-						rgba[index+2]=curLine8[inLineCount  ];
-						rgba[index+3]=curLine8[inLineCount+1];
-						index+=4;
-						x++;
-						inLineCount+=2;
-						inPixelCount=0;
-					}
-					break;
-				}
-				break;
+int YsRawPngDecoder::Output(unsigned char dat)
+{
+	return OutputSpan(&dat,1);
+}
 
+int YsRawPngDecoder::OutputSpan(const unsigned char dat[],size_t n)
+{
+	while(0<n)
+	{
+		if(8<=interlacePass)
+		{
+			return YSERR;  // More data than the image.
+		}
 
+		if(0==lineUsed)  // First byte is filter type for the line.
+		{
+			filter=dat[0];   // See PNG Specification 4.5.4 Filtering, 9 Filtering
+			dat++;
+			n--;
+			lineUsed=1;
+		}
+		else
+		{
+			size_t nCopy=1+lineLng-lineUsed;
+			if(n<nCopy)
+			{
+				nCopy=n;
+			}
+			memcpy(curLine8+lineUsed-1,dat,nCopy);
+			dat+=nCopy;
+			n-=nCopy;
+			lineUsed+=(unsigned int)nCopy;
+		}
 
-			// Truecolor with alpha
-			case 6:
-				switch(hdr.bitDepth)
-				{
-				case 8:
-					curLine8[inLineCount+inPixelCount]=dat;
-					inPixelCount++;
-					if(inPixelCount==4)
-					{
-						Filter8(curLine8,prvLine8,x,y,4,filter);
-						rgba[index  ]=curLine8[inLineCount  ];
-						rgba[index+1]=curLine8[inLineCount+1];
-						rgba[index+2]=curLine8[inLineCount+2];
-						rgba[index+3]=curLine8[inLineCount+3];
-						index+=4;
-						x++;
-						inLineCount+=4;
-						inPixelCount=0;
-					}
-					break;
-				}
-				break;
-			}  // switch(hdr.colorType)
+		if(1+lineLng==lineUsed)
+		{
+			UnfilterLine(YsPngUnfilterSet::Get(),curLine8,prvLine8,lineLng,(bitPerPixel+7)/8,filter);
+			ConvertLine();
+			ShiftTwoLineBuf();
+			lineUsed=0;
 
-			if(x>=wid)
+			const int lineY=passY0+y*passDy;
+			if(YSTRUE==IsLastPassOfLine(lineY) && LineCompleted(lineY)!=YSOK)
+			{
+				return YSERR;
+			}
+			y++;
+			if(passHei<=y)
 			{
-				y++;
-				x=-1;
-				ShiftTwoLineBuf();
+				interlacePass=(0==interlacePass ? 8 : interlacePass+1);
+				StartInterlacePass();
 			}
+		}
+	}
+	return YSOK;
+}
 
-			return YSOK;
-
+void YsRawPngDecoder::ConvertLine(void)
+{
+	// See PNG Specification 6.1 Colour types and values
+	const unsigned char *src=curLine8;
+	unsigned char *dst=rgba+((passY0+y*passDy)*wid+passX0)*4;
+	const int step=passDx*4;
+	int i;
 
-		// Interlace
+	switch(hdr.colorType)
+	{
+	// Grayscale
+	case 0:
+		switch(hdr.bitDepth)
+		{
 		case 1:
-			//   1 6 4 6 2 6 4 6
-			//   7 7 7 7 7 7 7 7
-			//   5 6 5 6 5 6 5 6
-			//   7 7 7 7 7 7 7 7
-			//   3 6 4 6 3 6 4 6
-			//   7 7 7 7 7 7 7 7
-			//   5 6 5 6 5 6 5 6
-			//   7 7 7 7 7 7 7 7
-			switch(interlacePass)
+			for(i=0; i<passWid; i++,dst+=step)
 			{
-			case 1:
-				interlaceWid=(wid+7)/8;
-				interlaceHei=(hei+7)/8;
-				interlaceX=x*8;
-				interlaceY=y*8;
-				break;
-			case 2:
-				interlaceWid=(wid+3)/8;
-				interlaceHei=(hei+7)/8;
-				interlaceX=4+x*8;
-				interlaceY=y*8;
-				break;
-			case 3:
-				interlaceWid=(wid+3)/4;
-				interlaceHei=(hei+3)/8;
-				interlaceX=x*4;
-				interlaceY=4+y*8;
-				break;
-			case 4:
-				interlaceWid=(wid+1)/4;
-				interlaceHei=(hei+3)/4;
-				interlaceX=2+x*4;
-				interlaceY=y*4;
-				break;
-			case 5:
-				interlaceWid=(wid+1)/2;
-				interlaceHei=(hei+1)/4;
-				interlaceX=x*2;
-				interlaceY=2+y*4;
-				break;
-			case 6:
-				interlaceWid=(wid  )/2;
-				interlaceHei=(hei+1)/2;
-				interlaceX=1+x*2;
-				interlaceY=y*2;
-				break;
-			case 7:
-				interlaceWid=wid;
-				interlaceHei=hei/2;
-				interlaceX=x;
-				interlaceY=1+y*2;
-				break;
-			default:
-				return YSERR;
-			} // switch(interlacePass)
-
-			switch(hdr.colorType)  // See PNG Specification 6.1 Colour types and values
+				const unsigned char v=(((src[i/8]>>(7-(i&7)))&1)!=0 ? 255 : 0);
+				dst[0]=v;
+				dst[1]=v;
+				dst[2]=v;
+				dst[3]=0;
+			}
+			break;
+		case 8:
+			for(i=0; i<passWid; i++,dst+=step)
 			{
-			// Grayscale
-			case 0:
-				switch(hdr.bitDepth)
-				{
-				case 8:
-					curLine8[inLineCount]=dat;
-					Filter8(curLine8,prvLine8,x,y,1,filter);
-
-					index=interlaceX*4+interlaceY*wid*4;
-					rgba[index  ]=curLine8[inLineCount];
-					rgba[index+1]=curLine8[inLineCount];
-					rgba[index+2]=curLine8[inLineCount];
-
-					if(curLine8[inLineCount]==trns.col[0] || 
-					   curLine8[inLineCount]==trns.col[1] || 
-					   curLine8[inLineCount]==trns.col[2])
-					{
-						rgba[index+3]=0;
-					}
-					else
-					{
-						rgba[index+3]=255;
-					}
-
-					x++;
-					inLineCount++;
-					break;
-				}
-				break;
+				const unsigned int v=src[i];
+				dst[0]=(unsigned char)v;
+				dst[1]=(unsigned char)v;
+				dst[2]=(unsigned char)v;
+				dst[3]=((v==trns.col[0] || v==trns.col[1] || v==trns.col[2]) ? 0 : 255);
+			}
+			break;
+		}
+		break;
 
+	// True color
+	case 2:
+		switch(hdr.bitDepth)
+		{
+		case 8:
+			for(i=0; i<passWid; i++,src+=3,dst+=step)
+			{
+				dst[0]=src[0];
+				dst[1]=src[1];
+				dst[2]=src[2];
+				dst[3]=((src[0]==trns.col[0] && src[1]==trns.col[1] && src[2]==trns.col[2]) ? 0 : 255);
+			}
+			break;
+		case 16:
+			for(i=0; i<passWid; i++,src+=6,dst+=step)
+			{
+				unsigned int r,g,b;
+				dst[0]=src[0];
+				dst[1]=src[2];
+				dst[2]=src[4];
+				r=src[0]*256+src[1];
+				g=src[2]*256+src[3];
+				b=src[4]*256+src[5];
+				dst[3]=((r==trns.col[0] && g==trns.col[1] && b==trns.col[2]) ? 0 : 255);
+			}
+			break;
+		}
+		break;
 
-			// True color
-			case 2:
-				switch(hdr.bitDepth)
+	// Indexed color
+	case 3:
+		{
+			const unsigned int bitDepth=hdr.bitDepth,mask=(1<<bitDepth)-1;
+			unsigned int colIdx;
+			int nMissing=0;
+			for(i=0; i<passWid; i++,dst+=step)
+			{
+				if(8==bitDepth)
 				{
-				case 8:
-					curLine8[inLineCount+inPixelCount]=dat;
-					inPixelCount++;
-					if(inPixelCount==3)
-					{
-						Filter8(curLine8,prvLine8,x,y,3,filter);
-
-						index=interlaceX*4+interlaceY*wid*4;
-						rgba[index  ]=curLine8[inLineCount  ];
-						rgba[index+1]=curLine8[inLineCount+1];
-						rgba[index+2]=curLine8[inLineCount+2];
-
-						if(curLine8[inLineCount  ]==trns.col[0] && 
-						   curLine8[inLineCount+1]==trns.col[1] && 
-						   curLine8[inLineCount+2]==trns.col[2])
-						{
-							rgba[index+3]=0;
-						}
-						else
-						{
-							rgba[index+3]=255;
-						}
-
-						x++;
-						inLineCount+=3;
-						inPixelCount=0;
-					}
-					break;
-
-				case 16:
-					curLine8[inLineCount+inPixelCount]=dat;
-					inPixelCount++;
-					if(inPixelCount==6)
-					{
-						Filter8(curLine8,prvLine8,x,y,6,filter);
-						index=interlaceX*4+interlaceY*wid*4;
-						rgba[index  ]=curLine8[inLineCount  ];
-						rgba[index+1]=curLine8[inLineCount+2];
-						rgba[index+2]=curLine8[inLineCount+4];
-
-						r=curLine8[inLineCount  ]*256+curLine8[inLineCount+1];
-						g=curLine8[inLineCount+2]*256+curLine8[inLineCount+3];
-						b=curLine8[inLineCount+4]*256+curLine8[inLineCount+5];
-
-						if(r==trns.col[0] && g==trns.col[1] && b==trns.col[2])
-						// Fixed based on a bug report from a viewer.  Thanks for the good catch!
-						//   Report received 09/10/2010
-						//   Fixed           09/18/2010
-						{
-							rgba[index+3]=0;
-						}
-						else
-						{
-							rgba[index+3]=255;
-						}
-
-						x++;
-						inLineCount+=6;
-						inPixelCount=0;
-					}
-					break;
+					colIdx=src[i];
 				}
-				break;
-
-
-
-			// Indexed color
-			case 3:
-				switch(hdr.bitDepth)
+				else
 				{
-				case 8:
-					curLine8[inLineCount]=dat;
-					Filter8(curLine8,prvLine8,x,y,1,filter);
-
-					index=interlaceX*4+interlaceY*wid*4;
-					colIdx=curLine8[inLineCount  ];
-					if(colIdx<plt.nEntry)
-					{
-						rgba[index  ]=plt.entry[colIdx*3  ];
-						rgba[index+1]=plt.entry[colIdx*3+1];
-						rgba[index+2]=plt.entry[colIdx*3+2];
-						if(colIdx==trns.col[0] || colIdx==trns.col[1] || colIdx==trns.col[2])
-						{
-							rgba[index+3]=0;
-						}
-						else
-						{
-							rgba[index+3]=255;
-						}
-					}
-
-					x++;
-					inLineCount++;
-					break;
+					const unsigned int bit=i*bitDepth;
+					colIdx=(src[bit/8]>>(8-bitDepth-(bit&7)))&mask;
 				}
-				break;
-
-
 
-			// Greyscale with alpha
-			case 4:
-				switch(hdr.bitDepth)
+				if(colIdx<plt.nEntry)
 				{
-				case 8:
-					curLine8[inLineCount+inPixelCount]=dat;
-					inPixelCount++;
-					if(inPixelCount==2)
-					{
-						Filter8(curLine8,prvLine8,x,y,2,filter);
-
-						index=interlaceX*4+interlaceY*wid*4;
-						rgba[index  ]=curLine8[inLineCount  ];
-						rgba[index+1]=curLine8[inLineCount  ];
-						rgba[index+2]=curLine8[inLineCount  ];
-						rgba[index+3]=curLine8[inLineCount+1];
-
-						x++;
-						inLineCount+=2;
-						inPixelCount=0;
-					}
-					break;
+					dst[0]=plt.entry[colIdx*3  ];
+					dst[1]=plt.entry[colIdx*3+1];
+					dst[2]=plt.entry[colIdx*3+2];
+					dst[3]=((colIdx==trns.col[0] || colIdx==trns.col[1] || colIdx==trns.col[2]) ? 0 : 255);
 				}
-				break;
-
-
-
-			// Truecolor with alpha
-			case 6:
-				switch(hdr.bitDepth)
+				else
 				{
-				case 8:
-					curLine8[inLineCount+inPixelCount]=dat;
-					inPixelCount++;
-					if(inPixelCount==4)
-					{
-						Filter8(curLine8,prvLine8,x,y,4,filter);
-
-						index=interlaceX*4+interlaceY*wid*4;
-						rgba[index  ]=curLine8[inLineCount  ];
-						rgba[index+1]=curLine8[inLineCount+1];
-						rgba[index+2]=curLine8[inLineCount+2];
-						rgba[index+3]=curLine8[inLineCount+3];
-
-						x++;
-						inLineCount+=4;
-						inPixelCount=0;
-					}
-					break;
+					nMissing++;
 				}
-			break;
-			} // switch(hdr.colorType)
-
-			if(x>=(int)interlaceWid)
+			}
+			if(0<nMissing)
 			{
-				y++;
-				x=-1;
-				ShiftTwoLineBuf();
-				if(y>=(int)interlaceHei)
-				{
-					y=0;
-					interlacePass++;
-
-					if(YsGenericPngDecoder::verboseMode==YSTRUE)
-					{
-						printf("Interlace Pass %d\n",interlacePass);
-					}
-				}
+				printf("Not enough palette entry! (%d)\n",plt.nEntry);
 			}
+		}
+		break;
 
-			return YSOK;
-		default:
-			printf("Unsupported interlace method.\n");
-			return YSERR;
+	// Greyscale with alpha
+	case 4:
+		for(i=0; i<passWid; i++,src+=2,dst+=step)
+		{
+			dst[0]=src[0];
+			dst[1]=src[0];
+			dst[2]=src[0];
+			dst[3]=src[1];
+		}
+		break;
+
+	// Truecolor with alpha
+	case 6:
+		if(1==passDx)
+		{
+			memcpy(dst,src,passWid*4);
+		}
+		else
+		{
+			for(i=0; i<passWid; i++,src+=4,dst+=step)
+			{
+				dst[0]=src[0];
+				dst[1]=src[1];
+				dst[2]=src[2];
+				dst[3]=src[3];
+			}
 		}
+		break;
 	}
-	// return YSERR;
 }
 
 int YsRawPngDecoder::EndOutput(void)
 {
 	if(YsGenericPngDecoder::verboseMode==YSTRUE)
 	{
-		printf("Final Position (%d,%d)\n",x,y);
+		printf("Final Position (pass %d, line %d)\n",interlacePass,y);
 	}
 	return YSOK;
 }
 
+int YsRawPngDecoder::LineCompleted(int)
+{
+	return YSOK;
+}
+
 void YsRawPngDecoder::Flip(void)  // For drawing in OpenGL
 {
 	int x,y,bytePerLine;
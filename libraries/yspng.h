@@ -32,6 +32,7 @@ OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 /* { */
 
 #include <stdio.h>
+#include <string.h>
 
 #ifndef YSRESULT_IS_DEFINED
 #define YSRESULT_IS_DEFINED
@@ -56,65 +57,223 @@ typedef enum
 
 
 
-class YsPngHuffmanTree
+/*! Bit reader of the de-compressor.
+    The bits are read from the least-significant bit of each byte.
+    Up to 64 bits are held in an accumulator, which is refilled by eight bytes at a time.
+    After Refill, at least 56 bits can be peeked and consumed without refilling again. */
+class YsPngBitReader
 {
-private:
-	YsPngHuffmanTree *zeroOne[2];
 public:
-	YsPngHuffmanTree();
-	~YsPngHuffmanTree();
-	unsigned int dat;
-	unsigned int weight,depth;
-	static int leakTracker;
+	const unsigned char *dat;
+	unsigned int length;
+	unsigned int bytePtr;           // Next byte to be loaded to the accumulator.
+	unsigned long long bitBuf;      // Bits loaded, but not consumed yet.
+	unsigned int nBitBuf;           // Number of bits in bitBuf.
 
-	static void DeleteHuffmanTree(YsPngHuffmanTree *node);
+	YsPngBitReader();
+	YsPngBitReader(unsigned length,const unsigned char dat[]);
 
-	inline YsPngHuffmanTree *&Zero(void)
+	static inline unsigned long long Load64(const unsigned char dat[])
 	{
-		return zeroOne[0];
+		unsigned long long value;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__==__ORDER_BIG_ENDIAN__
+		int i;
+		value=0;
+		for(i=7; i>=0; i--)
+		{
+			value=(value<<8)|dat[i];
+		}
+#else
+		memcpy(&value,dat,8);  // Unaligned load
+#endif
+		return value;
 	}
-	inline YsPngHuffmanTree *&One(void)
+
+	/*! Loads bytes until more than 56 bits are in the accumulator.
+	    Bytes beyond the end of the data are read as zero. */
+	inline void Refill(void)
 	{
-		return zeroOne[1];
+		if(bytePtr+8<=length)
+		{
+			bitBuf|=(Load64(dat+bytePtr)<<nBitBuf);
+			bytePtr+=(63-nBitBuf)>>3;
+			nBitBuf|=56;
+		}
+		else
+		{
+			while(nBitBuf<=56)
+			{
+				if(bytePtr<length)
+				{
+					bitBuf|=((unsigned long long)dat[bytePtr]<<nBitBuf);
+				}
+				bytePtr++;
+				nBitBuf+=8;
+			}
+		}
+	}
+	/*! Returns next n bits without consuming them.  n must not be more than the bits in the accumulator. */
+	inline unsigned int Peek(unsigned int n) const
+	{
+		return (unsigned int)(bitBuf&((1ull<<n)-1));
 	}
-	inline YsPngHuffmanTree *&Traverse(int zeroOrOne)
+	inline void Consume(unsigned int n)
+	{
+		bitBuf>>=n;
+		nBitBuf-=n;
+	}
+	/*! Returns and consumes next n bits.  n must not be more than 56. */
+	inline unsigned int GetBits(unsigned int n)
+	{
+		unsigned int value;
+		if(nBitBuf<n)
+		{
+			Refill();
+		}
+		value=Peek(n);
+		Consume(n);
+		return value;
+	}
+
+	/*! Returns the byte that includes the next bit. */
+	inline unsigned int GetBytePtr(void) const
 	{
-		return zeroOne[zeroOrOne];
+		return bytePtr-(nBitBuf+7)/8;
+	}
+	/*! Skips to the beginning of the next byte, unless the next bit already is. */
+	inline void AlignToByte(void)
+	{
+		Consume(nBitBuf&7);
+	}
+	/*! Empties the accumulator and moves to the byte.  Used for reading an uncompressed block directly from the data. */
+	inline void SeekByte(unsigned int newBytePtr)
+	{
+		bytePtr=newBytePtr;
+		bitBuf=0;
+		nBitBuf=0;
 	}
 };
 
-class YsPngUncompressor
+/*! Look-up table for decoding a Huffman code.
+    The next primaryBits bits of the stream, in the order they are read, index the primary table.
+    A code longer than primaryBits continues in a sub-table that the primary entry points to.
+    Therefore, a symbol is found by one or two look ups.
+    An entry also carries the number of extra bits that follows a copy-length or a distance code. */
+class YsPngHuffmanTable
 {
+private:
+	// Don't copy.
+	YsPngHuffmanTable(const YsPngHuffmanTable &);
+	YsPngHuffmanTable &operator=(const YsPngHuffmanTable &);
+
+	unsigned int *entry;
+	unsigned int nEntryAlloc;
+
 public:
-	class YsGenericPngDecoder *output;
+	enum
+	{
+		primaryBits=9,
+		maxCodeLength=15
+	};
+	enum
+	{
+		INVALID=0,   // Not a code of the table.
+		SYMBOL=1,    // Value is the symbol.
+		BASE=2,      // Value is the base of a copy length or a distance, extra bits follow.
+		SUBTABLE=3   // Value is the location of the sub-table.
+	};
+
+	YsPngHuffmanTable();
+	~YsPngHuffmanTable();
 
-	inline unsigned int GetNextBit(const unsigned char dat[],unsigned &bytePtr,unsigned &bitPtr)
+	/*! Makes the table from the code lengths and the codes.
+	    Symbols below nSymbol are decoded as they are.
+	    Symbol nSymbol+i (i<nBase) is decoded as base[i] followed by extraBits[i] extra bits.
+	    Other symbols are invalid. */
+	int Make(unsigned n,const unsigned hLength[],const unsigned hCode[],
+	         unsigned nSymbol,unsigned nBase,const unsigned short base[],const unsigned char extraBits[]);
+
+	/*! Returns the entry for the code at the beginning of bits.
+	    bits must hold the next maxCodeLength bits of the stream. */
+	inline unsigned int Lookup(unsigned int bits) const
 	{
-		unsigned a;
-		a=dat[bytePtr]&bitPtr;
-		bitPtr<<=1;
-		if(bitPtr>=256)
+		unsigned int e=entry[bits&((1<<primaryBits)-1)];
+		if(SUBTABLE==GetKind(e))
 		{
-			bitPtr=1;
-			bytePtr++;
+			e=entry[GetValue(e)+((bits>>primaryBits)&((1<<GetExtraBits(e))-1))];
 		}
-		return (a!=0 ? 1 : 0);
+		return e;
 	}
-	inline unsigned int GetNextMultiBit(const unsigned char dat[],unsigned &bytePtr,unsigned &bitPtr,unsigned n)
+
+	static inline unsigned int GetValue(unsigned int e)
 	{
-		unsigned value,mask,i;
-		value=0;
-		mask=1;
-		for(i=0; i<n; i++)
-		{
-			if(GetNextBit(dat,bytePtr,bitPtr))
-			{
-				value|=mask;
-			}
-			mask<<=1;
-		}
-		return value;
+		return e&0xffff;
+	}
+	static inline unsigned int GetCodeLength(unsigned int e)
+	{
+		return (e>>16)&15;
+	}
+	static inline unsigned int GetExtraBits(unsigned int e)
+	{
+		return (e>>20)&15;
+	}
+	static inline unsigned int GetKind(unsigned int e)
+	{
+		return e>>24;
 	}
+};
+
+/*! De-compressor of a zLib stream.
+    Uncompress takes the whole stream at once.
+    Or, the stream can be given in pieces of any size by BeginUncompress, PushCompressed, and EndUncompress.
+    The bytes de-compressed from a piece are given to the output before PushCompressed returns. */
+class YsPngUncompressor
+{
+private:
+	// Don't copy.
+	YsPngUncompressor(const YsPngUncompressor &);
+	YsPngUncompressor &operator=(const YsPngUncompressor &);
+
+public:
+	enum
+	{
+		STATE_ZLIBHEADER,
+		STATE_BLOCKHEADER,
+		STATE_STOREDHEADER,
+		STATE_STORED,
+		STATE_DYNAMICHEADER,
+		STATE_HUFFMAN,
+		STATE_END,
+		STATE_ERROR
+	};
+	enum
+	{
+		inBufSize=32768,
+		// Bytes from the byte that includes the next bit, which a step may read.
+		// Unless the piece is the last one, a step waits for the next piece if fewer bytes are left.
+		maxBlockHeaderLength=2,
+		maxStoredHeaderLength=5,
+		maxDynamicHeaderLength=600,  // Code lengths of a dynamic block take 569 bytes at most.
+		maxSymbolLength=7            // A copy length, a distance, and their extra bits take 48 bits at most.
+	};
+
+	class YsGenericPngDecoder *output;
+
+	int state;
+	unsigned int bFinal,bType;
+	unsigned int storedLength;  // Bytes left in the current uncompressed block
+	unsigned int windowSize,windowUsed,windowFlushed;
+	unsigned char *windowBuf;
+	unsigned int nByteExtracted;
+	YsPngHuffmanTable codeTable,distTable;
+	YsPngBitReader reader;
+
+	// Bytes given to PushCompressed, but not consumed yet
+	unsigned char *inBuf;
+	unsigned int inBufUsed;
+
+	YsPngUncompressor();
+	~YsPngUncompressor();
 
 	void MakeFixedHuffmanCode(unsigned hLength[288],unsigned hCode[288]);
 	static void MakeDynamicHuffmanCode(unsigned hLength[288],unsigned hCode[288],unsigned nLng,unsigned lng[]);
@@ -123,15 +282,24 @@ public:
 	    unsigned int *&hLengthLiteral,unsigned int *&hCodeLiteral,
 	    unsigned int *&hLengthDist,unsigned int *&hCodeDist,
 	    unsigned int hLengthBuf[322],unsigned int hCodeBuf[322],
-	    const unsigned char dat[],unsigned int &bytePtr,unsigned int &bitPtr);
+	    YsPngBitReader &reader);
 
-	YsPngHuffmanTree *MakeHuffmanTree(unsigned n,unsigned hLength[],unsigned hCode[]);
-	void DeleteHuffmanTree(YsPngHuffmanTree *node);
+	/*! Gives the bytes of the sliding window that are not given to the output yet.
+	    The window wraps around to the beginning if it is full. */
+	int FlushWindow(const unsigned char windowBuf[],unsigned &windowFlushed,unsigned &windowUsed,unsigned windowSize);
 
-	unsigned GetCopyLength(unsigned value,unsigned char dat[],unsigned &bytePtr,unsigned &bitPtr);
-	unsigned GetBackwardDistance(unsigned distCode,unsigned char dat[],unsigned &bytePtr,unsigned &bitPtr);
+	/*! Runs the de-compression as far as the data in the reader goes.
+	    Unless lastData is YSTRUE, it stops before a step that may need bytes that are not given yet. */
+	int Inflate(YSBOOL lastData);
+	/*! Decodes the symbols of the current block in the same manner as Inflate. */
+	int InflateHuffman(YSBOOL lastData);
 
 	int Uncompress(unsigned length,unsigned char dat[]);
+
+	void BeginUncompress(void);
+	int PushCompressed(const unsigned char dat[],size_t length);
+	/*! De-compresses the rest of the pieces, and releases the buffers. */
+	int EndUncompress(void);
 };
 
 ////////////////////////////////////////////////////////////
@@ -202,15 +370,44 @@ public:
 	{
 		gamma_default=100000
 	};
+	enum
+	{
+		STREAM_SIGNATURE,
+		STREAM_CHUNKHEADER,
+		STREAM_CHUNKDATA,
+		STREAM_CHUNKCRC,
+		STREAM_END,
+		STREAM_ERROR
+	};
+	enum
+	{
+		IMAGEDATA_NONE,
+		IMAGEDATA_STARTED,
+		IMAGEDATA_FINISHED
+	};
+	enum
+	{
+		readBufSize=16384,
+		maxBufferedChunkLength=4096  // Longer IHDR, PLTE, tRNS, or gAMA is ignored.
+	};
 
 	YsPngHeader hdr;
 	YsPngPalette plt;
 	YsPngTransparency trns;
 	unsigned int gamma;
 
+	// For incremental decoding
+	int streamState,imageDataState;
+	unsigned char streamBuf[8];  // Signature, length and type of a chunk, or CRC being received
+	unsigned int streamBufUsed;
+	unsigned int chunkType,chunkLength,chunkUsed;
+	unsigned char *chunkBuf;     // Data of IHDR, PLTE, tRNS, or gAMA being received
+	YsPngUncompressor uncompressor;
+
 	static unsigned int verboseMode;
 
 	YsGenericPngDecoder();
+	virtual ~YsGenericPngDecoder();
 	void Initialize(void);
 	int CheckSignature(YsPngGenericBinaryStream &binStream);
 	int ReadChunk(unsigned &length,unsigned char *&buf,unsigned &chunkType,unsigned &crc,YsPngGenericBinaryStream &binStream);
@@ -218,8 +415,26 @@ public:
 	int Decode(FILE *fp);
 	int Decode(YsPngGenericBinaryStream &binStream);
 
+	/*! Incremental decoding.
+	    Call BeginIncrementalDecode, then PushData with the PNG file in pieces of any size, then EndIncrementalDecode.
+	    IDAT chunks are de-compressed as they arrive, and the bytes are given to the output before PushData returns.
+	    The file does not have to be in memory at once. */
+	void BeginIncrementalDecode(void);
+	int PushData(const unsigned char dat[],size_t n);
+	int EndIncrementalDecode(void);
+
+	int BeginChunk(unsigned int length,unsigned int type);
+	int ChunkData(const unsigned char dat[],size_t n);
+	int EndChunk(void);
+	int BeginImageData(void);
+	int EndImageData(void);
+
 	virtual int PrepareOutput(void);
 	virtual int Output(unsigned char dat);
+	/*! Called with spans of de-compressed bytes.
+	    The default implementation calls Output for each byte.
+	    A decoder should override this function to take many bytes at a time. */
+	virtual int OutputSpan(const unsigned char dat[],size_t n);
 	virtual int EndOutput(void);
 };
 
@@ -251,27 +466,45 @@ public:
 	int autoDeleteRgbaBuffer;
 
 
-	int filter,x,y,firstByte;
-	int inLineCount;
-	int inPixelCount;
-	unsigned int r,g,b,msb;  // msb for reading 16 bit depth
-	unsigned int index;
+	int filter,y;
+	unsigned int bitPerPixel;
 
+	// Pass 0 for non-interlaced, 1 to 7 for interlaced, and 8 when all lines are decoded.
 	unsigned int interlacePass;
+	int passX0,passY0,passDx,passDy,passWid,passHei;
 
 	// For filtering
 	unsigned char *twoLineBuf8,*curLine8,*prvLine8;
+	unsigned int lineLng;   // Bytes per line of the current pass, excluding the filter byte
+	unsigned int lineUsed;  // Bytes received of the current line, including the filter byte
 
 	void ShiftTwoLineBuf(void);
+	void StartInterlacePass(void);
+	void ConvertLine(void);
+	YSBOOL IsLastPassOfLine(int lineY) const;
 
 	virtual int PrepareOutput(void);
 	virtual int Output(unsigned char dat);
+	virtual int OutputSpan(const unsigned char dat[],size_t n);
 	virtual int EndOutput(void);
 
+	/*! Called when all pixels of line lineY of rgba are decoded.  Lines are counted from the top.
+	    Lines of a non-interlaced PNG are completed in order.
+	    A line of an interlaced PNG is completed in the last pass that has pixels in the line.
+	    Return YSERR to stop decoding.  The default implementation does nothing. */
+	virtual int LineCompleted(int lineY);
+
 	void Flip(void);  // For drawing in OpenGL
 };
 
 
 
+/*! Compares the SIMD unfilter functions that the CPU can run against the scalar version,
+    for every filter type of 3- and 4-byte pixels.
+    Returns YSOK if all of them give the same lines.  Mismatches are printed. */
+int YsPngCheckUnfilter(void);
+
+
+
 /* } */
 #endif